@@ -12,23 +12,118 @@
 #include <memory>
 #include <fstream>
 #include <sstream>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <cstdio>
+#include <cstdlib>
+#include <charconv>
+#include <system_error>
+#include <array>
+#include <atomic>
+#include <cstdarg>
+#include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <future>
+#include <functional>
+#include <deque>
+#include <ctime>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NOTE_KERNELS_X86 1
+#else
+#define NOTE_KERNELS_X86 0
+#endif
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 const int SCREEN_WIDTH = 800;
 const int SCREEN_HEIGHT = 600;
 const int COLUMN_COUNT = 4;
 const int NOTE_HEIGHT = 20;
 const int NOTE_SPEED = 1000; // pixels per second
+const int MIN_NOTE_SPEED = 200;
+const int MAX_NOTE_SPEED = 3000;
+const int NOTE_SPEED_STEP = 100;
 const int JUDGMENT_LINE_Y = 500;
 const int KEY_AREA_HEIGHT = 100;
 const SDL_Keycode KEY_BINDINGS[4] = {SDLK_d, SDLK_f, SDLK_j, SDLK_k};
 
 const int AUDIO_FREQUENCY = 44100;
 const int AUDIO_CHANNELS = 2;
-const int AUDIO_CHUNKSIZE = 4096;
+const int DEFAULT_AUDIO_BUFFER_FRAMES = 512;
+const int MIN_AUDIO_BUFFER_FRAMES = 256;
+const int MAX_AUDIO_BUFFER_FRAMES = 1024;
+const double AUDIO_UNDERRUN_GAP = 2.0;  // callback gap, in buffers, counted as an underrun
+const uint32_t AUDIO_UNDERRUN_FALLBACK = 3; // underruns between plays before the buffer grows
+const Uint32 AUDIO_PROBE_TIMEOUT_MS = 500;
+const int MIXER_VOICES = 48;
+const size_t MIXER_COMMAND_CAPACITY = 256;
+const int MUSIC_VOICE = 0;
+const int FIRST_HITSOUND_VOICE = 1;
+const int HITSOUND_VOICES = 8;
+const float MUSIC_GAIN = 0.8f;
+const float HITSOUND_GAIN = 0.5f;
+const int FIRST_KEYSOUND_VOICE = 9;  // after the hitsound voices
+const int KEYSOUND_VOICES = 32;
+const float KEYSOUND_GAIN = 0.7f;
+const float KEYSOUND_LOOKAHEAD = 5.0f; // seconds decoded ahead of the playhead
+const int DEFAULT_KEYSOUND_BUDGET_MB = 256;
+const size_t KEYSOUND_REQUEST_CAPACITY = 4096;
+const char* const MUSIC_CACHE_DIRECTORY = "cache";
+static_assert(FIRST_KEYSOUND_VOICE == FIRST_HITSOUND_VOICE + HITSOUND_VOICES &&
+              FIRST_KEYSOUND_VOICE + KEYSOUND_VOICES <= MIXER_VOICES, "mixer voice ranges overlap");
+const int HITSOUND_LATENCY_SLOTS = 64;
+const char* const HITSOUND_FILE = "sounds/hit.wav";
+const unsigned MAX_ASSET_WORKERS = 4;
+const char* const REPLAY_DIRECTORY = "replays";
+const size_t REPLAY_RING_CAPACITY = 2048;  // key events between flushes
+const int REPLAY_FLUSH_INTERVAL_MS = 250;
+const size_t REPLAY_PENDING_CAPACITY = 4;  // plays begun between flushes
+const size_t REPLAY_WRITE_CHUNK = 4096;
 
+// Judgment windows in milliseconds either side of a note's hit time.
 const int PERFECT_WINDOW = 20;
 const int GREAT_WINDOW = 50;
 const int GOOD_WINDOW = 100;
+const int MISS_WINDOW = 100;
+const size_t MIN_HIT_ERROR_CAPACITY = 16384;
+
+const size_t FRAME_ARENA_SIZE = 64 * 1024;
+const int ALLOCATION_WARMUP_FRAMES = 120;
+const int PROFILE_REPORT_FRAMES = 300;
+const int FRAME_HISTOGRAM_BUCKETS = 10000;  // 10 us each; the last one holds anything slower
+const double DEFAULT_BENCHMARK_SECONDS = 30.0;
+const double STRESS_NOTE_INTERVAL = 0.005;  // 200 notes per second
+const double AUTOPLAY_HOLD = 0.03;          // seconds a key is held after its note
+const int DEFAULT_TARGET_FPS = 240;
+const int SIMULATION_RATE = 1000; // ticks per second
+const float SIMULATION_STEP = 1.0f / SIMULATION_RATE;
+const int MAX_SIMULATION_TICKS_PER_FRAME = 250;
+const size_t INPUT_QUEUE_CAPACITY = 1024;
+const int INPUT_POLL_INTERVAL_US = 500; // while the frame limiter spins
+const int FRAME_SPIN_MS = 2;
+const double CLOCK_SNAP_THRESHOLD = 0.05; // seconds of drift corrected in one step
+const double CLOCK_SLEW_RATE = 0.05;      // fraction of smaller drift corrected per frame
+const int TEXT_BATCH_GLYPHS = 1024;
 
 const int MIN_NOTES_PER_SPAWN = 1;
 const int MAX_NOTES_PER_SPAWN = 3;
@@ -43,211 +138,3596 @@ enum class JudgmentType {
     NONE
 };
 
+const uint16_t NO_SAMPLE = 0xFFFF;  // note without a keysound
+const size_t MAX_BEATMAP_SAMPLES = NO_SAMPLE;
+
 struct BeatmapNote {
     float time;
     int column;
+    uint16_t sample;
 };
 
-struct Note {
-    float position;  // Y position
-    int column;
-    bool hit;
-    bool missed;
-    SDL_Rect rect;
-    SDL_Color color;
+const SDL_Color COLUMN_COLORS[COLUMN_COUNT] = {
+    {255, 100, 100, 255}, // red
+    {100, 255, 100, 255}, // green
+    {100, 100, 255, 255}, // blue
+    {255, 255, 100, 255}  // yellow
+};
+
+// Half-widths, in ms, of each judgment band; an error exactly on a width
+// falls in the next band out. A press at least goodMs but less than missMs
+// from a note still takes the note, as a miss; a note
+// that is more than missMs late is missed automatically.
+struct JudgmentWindows {
+    int perfectMs;
+    int greatMs;
+    int goodMs;
+    int missMs;
+
+    static JudgmentWindows standard() {
+        return {PERFECT_WINDOW, GREAT_WINDOW, GOOD_WINDOW, MISS_WINDOW};
+    }
+
+    // osu!mania's overall difficulty table (OD 0-10), with its 300/200/100
+    // windows mapped onto PERFECT/GREAT/GOOD.
+    static JudgmentWindows fromOverallDifficulty(float od) {
+        od = std::clamp(od, 0.0f, 10.0f);
+        return {
+            static_cast<int>(64.0f - 3.0f * od),
+            static_cast<int>(97.0f - 3.0f * od),
+            static_cast<int>(127.0f - 3.0f * od),
+            static_cast<int>(188.0f - 3.0f * od)
+        };
+    }
+
+    // Ordered, and no wider than at OD 0, the most lenient the game plays at.
+    bool isValid() const {
+        JudgmentWindows loosest = fromOverallDifficulty(0.0f);
+        return perfectMs > 0 && perfectMs <= greatMs && greatMs <= goodMs && goodMs <= missMs &&
+               perfectMs <= loosest.perfectMs && greatMs <= loosest.greatMs &&
+               goodMs <= loosest.goodMs && missMs <= loosest.missMs;
+    }
 };
 
 struct Judgment {
     JudgmentType type;
     float displayTime;
     SDL_Color color;
-    std::string text;
+    const char* text;
+};
+
+// Counts every operator new on the calling thread, so the frame loop can check
+// that gameplay stops touching the heap once it has warmed up. Per thread, so
+// loader, decoder and writer threads running alongside are not charged to
+// the frame.
+thread_local uint64_t heapAllocationCount = 0;
+
+void* operator new(std::size_t size) {
+    heapAllocationCount++;
+    if (void* memory = std::malloc(size != 0 ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return ::operator new(size);
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+// Linear allocator that is reset at the start of every frame. Anything that
+// only has to live until the frame is presented, mostly formatted HUD text,
+// comes from here instead of the heap.
+class FrameArena {
+    private:
+        std::vector<char> buffer;
+        size_t used;
+
+    public:
+        explicit FrameArena(size_t capacity) : buffer(capacity), used(0) {}
+
+        void reset() {
+            used = 0;
+        }
+
+        // printf into the arena. Returns an empty string if the arena is full.
+        __attribute__((format(printf, 2, 3)))
+        const char* format(const char* fmt, ...) {
+            char* out = buffer.data() + used;
+            size_t remaining = buffer.size() - used;
+
+            va_list args;
+            va_start(args, fmt);
+            int length = std::vsnprintf(out, remaining, fmt, args);
+            va_end(args);
+
+            if (length < 0 || static_cast<size_t>(length) >= remaining) {
+                return "";
+            }
+            used += length + 1;
+            return out;
+        }
+    };
+
+// Read-only view of a whole file mapped into memory. Used for compiled
+// beatmaps so loading them costs a header check rather than a parse.
+class MappedFile {
+    private:
+        const unsigned char* data;
+        size_t size;
+#ifdef _WIN32
+        HANDLE fileHandle;
+        HANDLE mappingHandle;
+#endif
+
+    public:
+        MappedFile() : data(nullptr), size(0)
+#ifdef _WIN32
+            , fileHandle(INVALID_HANDLE_VALUE), mappingHandle(nullptr)
+#endif
+        {}
+
+        ~MappedFile() {
+            close();
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool open(const std::string& path) {
+            close();
+#ifdef _WIN32
+            fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (fileHandle == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) {
+                close();
+                return false;
+            }
+
+            mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mappingHandle == nullptr) {
+                close();
+                return false;
+            }
+
+            data = static_cast<const unsigned char*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+            if (data == nullptr) {
+                close();
+                return false;
+            }
+            size = static_cast<size_t>(fileSize.QuadPart);
+#else
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+
+            struct stat info;
+            if (fstat(fd, &info) != 0 || info.st_size == 0) {
+                ::close(fd);
+                return false;
+            }
+
+            void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (mapped == MAP_FAILED) {
+                return false;
+            }
+
+            data = static_cast<const unsigned char*>(mapped);
+            size = static_cast<size_t>(info.st_size);
+#endif
+            return true;
+        }
+
+        void close() {
+#ifdef _WIN32
+            if (data != nullptr) {
+                UnmapViewOfFile(data);
+            }
+            if (mappingHandle != nullptr) {
+                CloseHandle(mappingHandle);
+                mappingHandle = nullptr;
+            }
+            if (fileHandle != INVALID_HANDLE_VALUE) {
+                CloseHandle(fileHandle);
+                fileHandle = INVALID_HANDLE_VALUE;
+            }
+#else
+            if (data != nullptr) {
+                munmap(const_cast<unsigned char*>(data), size);
+            }
+#endif
+            data = nullptr;
+            size = 0;
+        }
+
+        bool isOpen() const { return data != nullptr; }
+        const unsigned char* getData() const { return data; }
+        size_t getSize() const { return size; }
+    };
+
+// Splits an in-memory buffer into lines without copying. A trailing '\r' is
+// stripped so CRLF beatmaps read the same on every platform.
+class LineReader {
+    private:
+        const char* cursor;
+        const char* end;
+        size_t lineNumber;
+
+    public:
+        LineReader(const char* data, size_t size) : cursor(data), end(data + size), lineNumber(0) {}
+
+        bool next(const char*& line, size_t& length) {
+            if (cursor >= end) return false;
+
+            const char* newline = static_cast<const char*>(std::memchr(cursor, '\n', end - cursor));
+            const char* lineEnd = newline != nullptr ? newline : end;
+
+            line = cursor;
+            length = static_cast<size_t>(lineEnd - cursor);
+            if (length > 0 && line[length - 1] == '\r') {
+                length--;
+            }
+
+            cursor = newline != nullptr ? newline + 1 : end;
+            lineNumber++;
+            return true;
+        }
+
+        size_t getLineNumber() const { return lineNumber; }
+    };
+
+// Parses a whole field as a number, allowing surrounding spaces or tabs.
+template <typename T>
+bool parseNumberField(const char* begin, const char* end, T& value) {
+    while (begin < end && (*begin == ' ' || *begin == '\t')) begin++;
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t')) end--;
+
+    auto result = std::from_chars(begin, end, value);
+    return result.ec == std::errc() && result.ptr == end;
+}
+
+// Collects beatmap parse errors so a badly broken file produces a short
+// summary instead of one log line per note.
+class BeatmapParseErrors {
+    private:
+        static const size_t MAX_REPORTED = 8;
+
+        size_t lines[MAX_REPORTED];
+        const char* messages[MAX_REPORTED];
+        size_t count;
+
+    public:
+        BeatmapParseErrors() : count(0) {}
+
+        void add(size_t line, const char* message) {
+            if (count < MAX_REPORTED) {
+                lines[count] = line;
+                messages[count] = message;
+            }
+            count++;
+        }
+
+        void report(const std::string& sourceName) const {
+            for (size_t i = 0; i < count && i < MAX_REPORTED; i++) {
+                std::cerr << "Error parsing " << sourceName << " line " << lines[i]
+                          << ": " << messages[i] << std::endl;
+            }
+            if (count > MAX_REPORTED) {
+                std::cerr << "... " << (count - MAX_REPORTED) << " more errors in " << sourceName << std::endl;
+            }
+        }
+    };
+
+// On-disk layout of a compiled beatmap (little-endian):
+//   CompiledBeatmapHeader
+//   title bytes, music file bytes, zero padding up to a 4-byte boundary
+//   float   times[noteCount]     (sorted ascending)
+//   uint8_t columns[noteCount]
+// Version 2 adds keysounds. When sampleCount is non-zero, the columns are
+// followed by padding up to a 2-byte boundary and
+//   uint16_t samples[noteCount]  (index into the name table, or NO_SAMPLE)
+//   sampleCount x {uint16_t length, name bytes}
+// The source stamp lets a cached compile be rejected once the text file changes.
+const char COMPILED_BEATMAP_MAGIC[4] = {'O', 'M', 'B', 'C'};
+const uint32_t COMPILED_BEATMAP_VERSION = 2;
+const char* const COMPILED_BEATMAP_EXTENSION = ".omb";
+
+struct CompiledBeatmapHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t noteCount;
+    uint32_t titleLength;
+    uint32_t musicFileLength;
+    float offset;
+    float songLength;
+    uint32_t sampleCount;  // 0 in version 1
+    int64_t sourceSize;
+    int64_t sourceModifiedTime;
+};
+
+static_assert(sizeof(CompiledBeatmapHeader) == 48, "compiled beatmap header must stay packed");
+
+struct BeatmapSourceStamp {
+    int64_t size;
+    int64_t modifiedTime;
 };
 
 class Beatmap {
     private:
-        std::vector<BeatmapNote> notes;
-        bool loaded;
+        // Notes are stored as parallel arrays. They either point into the
+        // owned vectors below (text beatmaps) or straight into the mapped
+        // compiled file.
+        const float* noteTimes;
+        const uint8_t* noteColumns;
+        const uint16_t* noteSamples;  // null when the chart has no keysounds
+        size_t noteCount;
+
+        std::vector<float> ownedTimes;
+        std::vector<uint8_t> ownedColumns;
+        std::vector<uint16_t> ownedSamples;
+        std::vector<std::string> sampleNames;
+        MappedFile mapping;
+
         std::string title;
         std::string musicFile;
         float offset;
         float songLength;
+
+        void clear() {
+            noteTimes = nullptr;
+            noteColumns = nullptr;
+            noteSamples = nullptr;
+            noteCount = 0;
+            ownedTimes.clear();
+            ownedColumns.clear();
+            ownedSamples.clear();
+            sampleNames.clear();
+            mapping.close();
+            title.clear();
+            musicFile.clear();
+            offset = 0.0f;
+            songLength = 0.0f;
+        }
+
+        static bool endsWith(const std::string& value, const char* suffix) {
+            size_t suffixLength = std::strlen(suffix);
+            return value.size() >= suffixLength &&
+                   value.compare(value.size() - suffixLength, suffixLength, suffix) == 0;
+        }
+
+        static bool getSourceStamp(const std::string& filename, BeatmapSourceStamp& stamp) {
+            std::error_code error;
+            uintmax_t size = std::filesystem::file_size(filename, error);
+            if (error) return false;
+
+            auto modified = std::filesystem::last_write_time(filename, error);
+            if (error) return false;
+
+            stamp.size = static_cast<int64_t>(size);
+            stamp.modifiedTime = static_cast<int64_t>(modified.time_since_epoch().count());
+            return true;
+        }
+
+        bool loadFromText(const std::string& filename) {
+            MappedFile file;
+            if (!file.open(filename)) {
+                std::cerr << "Failed to open beatmap file: " << filename << std::endl;
+                return false;
+            }
+
+            return parseText(reinterpret_cast<const char*>(file.getData()), file.getSize(), filename);
+        }
+
+        // Maps a compiled beatmap and points the note arrays into it. When
+        // expectedSource is given, the file is only accepted if it was built
+        // from a source with that exact size and modification time.
+        bool loadCompiled(const std::string& filename, const BeatmapSourceStamp* expectedSource) {
+            if (!mapping.open(filename)) {
+                return false;
+            }
+
+            const unsigned char* base = mapping.getData();
+            size_t fileSize = mapping.getSize();
+
+            CompiledBeatmapHeader header;
+            if (fileSize < sizeof(header)) {
+                std::cerr << "Compiled beatmap is truncated: " << filename << std::endl;
+                mapping.close();
+                return false;
+            }
+            std::memcpy(&header, base, sizeof(header));
+
+            if (std::memcmp(header.magic, COMPILED_BEATMAP_MAGIC, sizeof(header.magic)) != 0 ||
+                header.version < 1 || header.version > COMPILED_BEATMAP_VERSION ||
+                (header.version == 1 && header.sampleCount != 0)) {
+                std::cerr << "Unsupported compiled beatmap format: " << filename << std::endl;
+                mapping.close();
+                return false;
+            }
+
+            if (expectedSource != nullptr &&
+                (header.sourceSize != expectedSource->size ||
+                 header.sourceModifiedTime != expectedSource->modifiedTime)) {
+                mapping.close();
+                return false;
+            }
+
+            size_t stringsEnd = sizeof(header) + header.titleLength + header.musicFileLength;
+            size_t timesOffset = (stringsEnd + 3) & ~static_cast<size_t>(3);
+            size_t columnsOffset = timesOffset + header.noteCount * sizeof(float);
+            if (columnsOffset + header.noteCount > fileSize) {
+                std::cerr << "Compiled beatmap is truncated: " << filename << std::endl;
+                mapping.close();
+                return false;
+            }
+
+            size_t samplesOffset = (columnsOffset + header.noteCount + 1) & ~static_cast<size_t>(1);
+            size_t namesOffset = samplesOffset + header.noteCount * sizeof(uint16_t);
+            if (header.sampleCount > 0 &&
+                (header.sampleCount > MAX_BEATMAP_SAMPLES || namesOffset > fileSize)) {
+                std::cerr << "Compiled beatmap is truncated: " << filename << std::endl;
+                mapping.close();
+                return false;
+            }
+
+            const uint8_t* columns = base + columnsOffset;
+            uint8_t maxColumn = 0;
+            for (uint32_t i = 0; i < header.noteCount; i++) {
+                maxColumn = std::max(maxColumn, columns[i]);
+            }
+            if (header.noteCount > 0 && maxColumn >= COLUMN_COUNT) {
+                std::cerr << "Compiled beatmap has notes outside the playfield: " << filename << std::endl;
+                mapping.close();
+                return false;
+            }
+
+            if (header.sampleCount > 0) {
+                const uint16_t* samples = reinterpret_cast<const uint16_t*>(base + samplesOffset);
+                for (uint32_t i = 0; i < header.noteCount; i++) {
+                    if (samples[i] != NO_SAMPLE && samples[i] >= header.sampleCount) {
+                        std::cerr << "Compiled beatmap has an unknown keysound: " << filename << std::endl;
+                        mapping.close();
+                        return false;
+                    }
+                }
+
+                size_t cursor = namesOffset;
+                sampleNames.reserve(header.sampleCount);
+                for (uint32_t i = 0; i < header.sampleCount; i++) {
+                    uint16_t length;
+                    if (cursor + sizeof(length) > fileSize) break;
+                    std::memcpy(&length, base + cursor, sizeof(length));
+                    cursor += sizeof(length);
+                    if (cursor + length > fileSize) break;
+                    sampleNames.emplace_back(reinterpret_cast<const char*>(base + cursor), length);
+                    cursor += length;
+                }
+                if (sampleNames.size() != header.sampleCount) {
+                    std::cerr << "Compiled beatmap is truncated: " << filename << std::endl;
+                    sampleNames.clear();
+                    mapping.close();
+                    return false;
+                }
+                noteSamples = samples;
+            }
+
+            const char* strings = reinterpret_cast<const char*>(base + sizeof(header));
+            title.assign(strings, header.titleLength);
+            musicFile.assign(strings + header.titleLength, header.musicFileLength);
+            offset = header.offset;
+            songLength = header.songLength;
+
+            noteTimes = reinterpret_cast<const float*>(base + timesOffset);
+            noteColumns = columns;
+            noteCount = header.noteCount;
+            return true;
+        }
         
     public:
-        Beatmap() : loaded(false), songLength(0.0f), offset(0.0f) {}
+        Beatmap() : noteTimes(nullptr), noteColumns(nullptr), noteSamples(nullptr), noteCount(0),
+                    offset(0.0f), songLength(0.0f) {}
+
+        Beatmap(const Beatmap&) = delete;
+        Beatmap& operator=(const Beatmap&) = delete;
         
+        // Loads either a compiled beatmap directly, or a text beatmap through
+        // its compiled cache (<file>.omb), rebuilding the cache when the text
+        // file is newer than it.
         bool loadFromFile(const std::string& filename) {
-            std::ifstream file(filename);
-            if (!file.is_open()) {
-                std::cerr << "Failed to open beatmap file: " << filename << std::endl;
-                return false;
+            clear();
+
+            if (endsWith(filename, COMPILED_BEATMAP_EXTENSION)) {
+                if (!loadCompiled(filename, nullptr)) {
+                    std::cerr << "Failed to load compiled beatmap: " << filename << std::endl;
+                    clear();
+                    return false;
+                }
+            } else {
+                std::string cacheFile = filename + COMPILED_BEATMAP_EXTENSION;
+                BeatmapSourceStamp stamp;
+                bool haveStamp = getSourceStamp(filename, stamp);
+
+                if (!haveStamp || !loadCompiled(cacheFile, &stamp)) {
+                    clear();
+                    if (!loadFromText(filename)) {
+                        clear();
+                        return false;
+                    }
+
+                    if (haveStamp && noteCount > 0) {
+                        saveCompiled(cacheFile, stamp);
+                    }
+                }
             }
             
-            notes.clear();
-            std::string line;
-            
-            if (std::getline(file, line)) {
-                title = line;
+            return noteCount > 0 && !musicFile.empty();
+        }
+
+        // Parses a whole text beatmap held in memory. Lines are walked in place
+        // and numbers read with std::from_chars, so nothing is allocated per
+        // line. Malformed note lines are skipped and reported; this never throws.
+        // A note line is "time,column" or, in a keysounded chart,
+        // "time,column,sample" with the sample file relative to the chart.
+        bool parseText(const char* data, size_t size, const std::string& sourceName) {
+            clear();
+
+            LineReader reader(data, size);
+            BeatmapParseErrors errors;
+            const char* line;
+            size_t length;
+
+            if (reader.next(line, length)) {
+                title.assign(line, length);
             }
-            
-            if (std::getline(file, line)) {
-                musicFile = line;
+
+            if (reader.next(line, length)) {
+                musicFile.assign(line, length);
             }
-            
-            if (std::getline(file, line)) {
-                try {
-                    offset = std::stof(line) / 1000.0f;
-                } catch (const std::exception& e) {
-                    std::cerr << "Error parsing offset: " << line << " - " << e.what() << std::endl;
-                    offset = 0.0f;
+
+            if (reader.next(line, length)) {
+                float offsetMs;
+                if (parseNumberField(line, line + length, offsetMs)) {
+                    offset = offsetMs / 1000.0f;
+                } else {
+                    errors.add(reader.getLineNumber(), "invalid offset");
                 }
             }
-            
-            while (std::getline(file, line)) {
-                std::istringstream iss(line);
-                std::string timeStr, columnStr;
-                
-                if (line.empty() || line[0] == '#' || line[0] == '/') {
+
+            std::vector<BeatmapNote> notes;
+            notes.reserve(size / 8);
+            bool sorted = true;
+            std::unordered_map<std::string, uint16_t> sampleIds;
+            std::string sampleName;
+
+            while (reader.next(line, length)) {
+                if (length == 0 || line[0] == '#' || line[0] == '/') {
                     continue;
                 }
-                
-                if (std::getline(iss, timeStr, ',') && std::getline(iss, columnStr)) {
-                    try {
-                        float time = std::stof(timeStr);
-                        int column = std::stoi(columnStr);
-                        
-                        if (column >= 0 && column < COLUMN_COUNT) {
-                            BeatmapNote note;
-                            note.time = time;
-                            note.column = column;
-                            notes.push_back(note);
-                            
-                            if (time > songLength) {
-                                songLength = time;
-                            }
+
+                const char* end = line + length;
+                const char* comma = static_cast<const char*>(std::memchr(line, ',', length));
+                if (comma == nullptr) {
+                    continue;
+                }
+
+                const char* columnEnd = static_cast<const char*>(std::memchr(comma + 1, ',', end - comma - 1));
+                if (columnEnd == nullptr) {
+                    columnEnd = end;
+                }
+
+                BeatmapNote note;
+                note.sample = NO_SAMPLE;
+                if (!parseNumberField(line, comma, note.time)) {
+                    errors.add(reader.getLineNumber(), "invalid note time");
+                    continue;
+                }
+                if (!parseNumberField(comma + 1, columnEnd, note.column)) {
+                    errors.add(reader.getLineNumber(), "invalid column");
+                    continue;
+                }
+
+                if (columnEnd != end) {
+                    const char* nameBegin = columnEnd + 1;
+                    const char* nameEnd = end;
+                    while (nameBegin < nameEnd && (*nameBegin == ' ' || *nameBegin == '\t')) nameBegin++;
+                    while (nameEnd > nameBegin && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t')) nameEnd--;
+                    if (nameBegin != nameEnd) {
+                        sampleName.assign(nameBegin, nameEnd);
+                        auto found = sampleIds.find(sampleName);
+                        if (found != sampleIds.end()) {
+                            note.sample = found->second;
+                        } else if (sampleNames.size() < MAX_BEATMAP_SAMPLES) {
+                            note.sample = static_cast<uint16_t>(sampleNames.size());
+                            sampleIds.emplace(sampleName, note.sample);
+                            sampleNames.push_back(sampleName);
+                        } else {
+                            errors.add(reader.getLineNumber(), "too many keysound samples");
                         }
-                    } catch (const std::exception& e) {
-                        std::cerr << "Error parsing line: " << line << " - " << e.what() << std::endl;
+                    }
+                }
+
+                if (note.column >= 0 && note.column < COLUMN_COUNT) {
+                    if (!notes.empty() && note.time < notes.back().time) {
+                        sorted = false;
+                    }
+                    notes.push_back(note);
+
+                    if (note.time > songLength) {
+                        songLength = note.time;
                     }
                 }
             }
-            
+
+            errors.report(sourceName);
             songLength += 5.0f;
-            
-            std::sort(notes.begin(), notes.end(), 
-                  [](const BeatmapNote& a, const BeatmapNote& b) {
-                      return a.time < b.time;
-                  });
-            
-            loaded = !notes.empty() && !musicFile.empty();
-            return loaded;
+
+            if (!sorted) {
+                std::stable_sort(notes.begin(), notes.end(),
+                      [](const BeatmapNote& a, const BeatmapNote& b) {
+                          return a.time < b.time;
+                      });
+            }
+
+            ownedTimes.resize(notes.size());
+            ownedColumns.resize(notes.size());
+            if (!sampleNames.empty()) {
+                ownedSamples.resize(notes.size());
+            }
+            for (size_t i = 0; i < notes.size(); i++) {
+                ownedTimes[i] = notes[i].time;
+                ownedColumns[i] = static_cast<uint8_t>(notes[i].column);
+                if (!sampleNames.empty()) {
+                    ownedSamples[i] = notes[i].sample;
+                }
+            }
+
+            noteTimes = ownedTimes.data();
+            noteColumns = ownedColumns.data();
+            noteSamples = sampleNames.empty() ? nullptr : ownedSamples.data();
+            noteCount = notes.size();
+            return true;
+        }
+
+        // Written beside the target and renamed into place, so a loader, or
+        // a chart that still has the old file mapped, never sees it torn.
+        // The partial name is per thread, as two loads can save at once.
+        bool saveCompiled(const std::string& filename, const BeatmapSourceStamp& source) const {
+            std::string partialPath = filename + "." +
+                                      std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".part";
+            std::ofstream out(partialPath, std::ios::binary | std::ios::trunc);
+            if (!out.is_open()) {
+                std::cerr << "Failed to write compiled beatmap: " << filename << std::endl;
+                return false;
+            }
+
+            CompiledBeatmapHeader header = {};
+            std::memcpy(header.magic, COMPILED_BEATMAP_MAGIC, sizeof(header.magic));
+            header.version = COMPILED_BEATMAP_VERSION;
+            header.noteCount = static_cast<uint32_t>(noteCount);
+            header.titleLength = static_cast<uint32_t>(title.size());
+            header.musicFileLength = static_cast<uint32_t>(musicFile.size());
+            header.offset = offset;
+            header.songLength = songLength;
+            header.sampleCount = static_cast<uint32_t>(sampleNames.size());
+            header.sourceSize = source.size;
+            header.sourceModifiedTime = source.modifiedTime;
+
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(title.data(), title.size());
+            out.write(musicFile.data(), musicFile.size());
+
+            size_t stringsEnd = sizeof(header) + title.size() + musicFile.size();
+            static const char padding[4] = {0, 0, 0, 0};
+            out.write(padding, ((stringsEnd + 3) & ~static_cast<size_t>(3)) - stringsEnd);
+
+            out.write(reinterpret_cast<const char*>(noteTimes), noteCount * sizeof(float));
+            out.write(reinterpret_cast<const char*>(noteColumns), noteCount);
+
+            if (!sampleNames.empty()) {
+                size_t columnsEnd = ((stringsEnd + 3) & ~static_cast<size_t>(3)) + noteCount * (sizeof(float) + 1);
+                out.write(padding, columnsEnd & 1);
+                out.write(reinterpret_cast<const char*>(noteSamples), noteCount * sizeof(uint16_t));
+                for (const std::string& name : sampleNames) {
+                    uint16_t length = static_cast<uint16_t>(std::min<size_t>(name.size(), 0xFFFF));
+                    out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+                    out.write(name.data(), length);
+                }
+            }
+
+            bool written = out.good();
+            out.close();
+            std::error_code error;
+            if (written) {
+                std::filesystem::rename(partialPath, filename, error);
+            }
+            if (!written || error) {
+                std::cerr << "Failed to write compiled beatmap: " << filename << std::endl;
+                std::filesystem::remove(partialPath, error);
+                return false;
+            }
+            return true;
+        }
+
+        // Converts a text beatmap into the compiled format, bypassing the cache.
+        static bool compile(const std::string& textFile, const std::string& outputFile) {
+            Beatmap beatmap;
+            BeatmapSourceStamp stamp;
+            if (!getSourceStamp(textFile, stamp) || !beatmap.loadFromText(textFile)) {
+                std::cerr << "Failed to read beatmap: " << textFile << std::endl;
+                return false;
+            }
+
+            if (!beatmap.saveCompiled(outputFile, stamp)) {
+                return false;
+            }
+
+            std::cout << "Compiled " << beatmap.noteCount << " notes to " << outputFile << std::endl;
+            return true;
         }
         
-        bool isLoaded() const { return loaded; }
         const std::string& getTitle() const { return title; }
         const std::string& getMusicFile() const { return musicFile; }
         float getOffset() const { return offset; }
         float getSongLength() const { return songLength; }
         
-        std::vector<int> getNotesAtTime(float currentTime) {
-            std::vector<int> columns;
-            
-            for (auto it = notes.begin(); it != notes.end(); ) {
-                if (std::abs(it->time - currentTime) < 0.01f) {
-                    columns.push_back(it->column);
-                    it = notes.erase(it);
-                } else if (it->time > currentTime) {
-                    break;
-                } else {
-                    ++it;
+        size_t getNoteCount() const { return noteCount; }
+        const float* getNoteTimes() const { return noteTimes; }
+        const uint8_t* getNoteColumns() const { return noteColumns; }
+        const uint16_t* getNoteSamples() const { return noteSamples; }
+        size_t getSampleCount() const { return sampleNames.size(); }
+        const std::string& getSampleName(size_t index) const { return sampleNames[index]; }
+
+        // Index of the note at exactly `time` in `column`, or getNoteCount().
+        size_t findNote(float time, int column) const {
+            size_t index = std::lower_bound(noteTimes, noteTimes + noteCount, time) - noteTimes;
+            for (; index < noteCount && noteTimes[index] == time; index++) {
+                if (noteColumns[index] == column) {
+                    return index;
                 }
             }
-            
-            return columns;
-        }
-        
-        bool hasMoreNotes() const {
-            return !notes.empty();
+            return noteCount;
         }
     };
 
-class OsuMania {
-private:
-    SDL_Window* window;
-    SDL_Renderer* renderer;
-    TTF_Font* font;
+// Walks a beatmap's sorted note list with a monotonic cursor. Each call to
+// advance() emits every note whose time falls in (lastTime, currentTime], so a
+// long frame simply catches up instead of skipping notes, and nothing is ever
+// erased from the beatmap itself.
+class NoteScheduler {
+    private:
+        const Beatmap* beatmap;
+        size_t cursor;
 
-    Mix_Music* music;
-    bool musicPlaying;
-    float musicStartTime;
-    bool musicLoaded;
-    
-    std::vector<Note> notes;
-    bool keyStates[COLUMN_COUNT];
-    bool gameRunning;
-    bool gameStarted;
-    bool gameEnded;
+    public:
+        NoteScheduler() : beatmap(nullptr), cursor(0) {}
+
+        void reset(const Beatmap& source) {
+            beatmap = &source;
+            cursor = 0;
+        }
+
+        template <typename EmitFn>
+        void advance(float currentTime, EmitFn emit) {
+            if (beatmap == nullptr) return;
+
+            const float* times = beatmap->getNoteTimes();
+            const uint8_t* columns = beatmap->getNoteColumns();
+            const size_t count = beatmap->getNoteCount();
+            while (cursor < count && times[cursor] <= currentTime) {
+                emit(times[cursor], static_cast<int>(columns[cursor]));
+                ++cursor;
+            }
+        }
+
+        bool hasMoreNotes() const {
+            return beatmap != nullptr && cursor < beatmap->getNoteCount();
+        }
+
+        // Hit time of the next note to spawn; only valid while hasMoreNotes().
+        float getNextTime() const { return beatmap->getNoteTimes()[cursor]; }
+    };
+
+// Batch kernels over a column's hit times. Each has a scalar version and, on
+// x86, SSE2 and AVX2 versions picked once at startup from SDL's CPU detection.
+//   projectY:    y[i] = lineY - (hitTimes[i] - songTime) * speed, the top
+//                edge of each note, touching lineY exactly at its hit time
+//   countBefore: number of leading hit times < cutoff; the input is sorted,
+//                so this stops at the first block that is not all expired
+namespace NoteKernels {
+    void projectYScalar(const float* hitTimes, size_t count, float songTime, float speed, float lineY, float* outY) {
+        for (size_t i = 0; i < count; i++) {
+            outY[i] = lineY - (hitTimes[i] - songTime) * speed;
+        }
+    }
+
+    size_t countBeforeScalar(const float* hitTimes, size_t count, float cutoff) {
+        size_t expired = 0;
+        while (expired < count && hitTimes[expired] < cutoff) {
+            expired++;
+        }
+        return expired;
+    }
+
+#if NOTE_KERNELS_X86
+    void projectYSse2(const float* hitTimes, size_t count, float songTime, float speed, float lineY, float* outY) {
+        const __m128 songTimeVec = _mm_set1_ps(songTime);
+        const __m128 speedVec = _mm_set1_ps(speed);
+        const __m128 lineYVec = _mm_set1_ps(lineY);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128 untilHit = _mm_sub_ps(_mm_loadu_ps(hitTimes + i), songTimeVec);
+            _mm_storeu_ps(outY + i, _mm_sub_ps(lineYVec, _mm_mul_ps(untilHit, speedVec)));
+        }
+        projectYScalar(hitTimes + i, count - i, songTime, speed, lineY, outY + i);
+    }
+
+    size_t countBeforeSse2(const float* hitTimes, size_t count, float cutoff) {
+        const __m128 cutoffVec = _mm_set1_ps(cutoff);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            int mask = _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(hitTimes + i), cutoffVec));
+            if (mask != 0xF) {
+                return i + __builtin_popcount(mask);
+            }
+        }
+        return i + countBeforeScalar(hitTimes + i, count - i, cutoff);
+    }
+
+    __attribute__((target("avx2")))
+    void projectYAvx2(const float* hitTimes, size_t count, float songTime, float speed, float lineY, float* outY) {
+        const __m256 songTimeVec = _mm256_set1_ps(songTime);
+        const __m256 speedVec = _mm256_set1_ps(speed);
+        const __m256 lineYVec = _mm256_set1_ps(lineY);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256 untilHit = _mm256_sub_ps(_mm256_loadu_ps(hitTimes + i), songTimeVec);
+            _mm256_storeu_ps(outY + i, _mm256_sub_ps(lineYVec, _mm256_mul_ps(untilHit, speedVec)));
+        }
+        projectYScalar(hitTimes + i, count - i, songTime, speed, lineY, outY + i);
+    }
+
+    __attribute__((target("avx2")))
+    size_t countBeforeAvx2(const float* hitTimes, size_t count, float cutoff) {
+        const __m256 cutoffVec = _mm256_set1_ps(cutoff);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(hitTimes + i), cutoffVec, _CMP_LT_OQ));
+            if (mask != 0xFF) {
+                return i + __builtin_popcount(mask);
+            }
+        }
+        return i + countBeforeScalar(hitTimes + i, count - i, cutoff);
+    }
+#endif
+
+    struct Table {
+        const char* name;
+        void (*projectY)(const float*, size_t, float, float, float, float*);
+        size_t (*countBefore)(const float*, size_t, float);
+    };
+
+    const Table SCALAR = {"scalar", projectYScalar, countBeforeScalar};
+#if NOTE_KERNELS_X86
+    const Table SSE2 = {"sse2", projectYSse2, countBeforeSse2};
+    const Table AVX2 = {"avx2", projectYAvx2, countBeforeAvx2};
+#endif
+
+    const Table& best() {
+        static const Table& table =
+#if NOTE_KERNELS_X86
+            SDL_HasAVX2() ? AVX2 : SDL_HasSSE2() ? SSE2 :
+#endif
+            SCALAR;
+        return table;
+    }
+}
+
+// The live notes of one column, oldest first, kept as a ring buffer of hit
+// times. A live note only knows when it should be hit; where it is on screen
+// is derived from the song time (see NoteKernels::projectY). Because notes leave
+// a column in time order, judging and miss checks only look at the front.
+class NoteQueue {
+    private:
+        static const size_t INITIAL_CAPACITY = 64;
+
+        std::vector<float> hitTimes;  // capacity is always a power of two
+        size_t head;
+        size_t count;
+
+        size_t slot(size_t index) const {
+            return (head + index) & (hitTimes.size() - 1);
+        }
+
+        void grow() {
+            std::vector<float> larger(hitTimes.size() * 2);
+            for (size_t i = 0; i < count; i++) {
+                larger[i] = hitTimes[slot(i)];
+            }
+            hitTimes.swap(larger);
+            head = 0;
+        }
+
+    public:
+        NoteQueue() : hitTimes(INITIAL_CAPACITY), head(0), count(0) {}
+
+        // Appends a note, keeping the queue sorted. Notes almost always arrive
+        // in order, so this rarely moves anything.
+        void push(float hitTime) {
+            if (count == hitTimes.size()) {
+                grow();
+            }
+
+            size_t index = count++;
+            while (index > 0 && hitTimes[slot(index - 1)] > hitTime) {
+                hitTimes[slot(index)] = hitTimes[slot(index - 1)];
+                index--;
+            }
+            hitTimes[slot(index)] = hitTime;
+        }
+
+        void popFront() {
+            head = slot(1);
+            count--;
+        }
+
+        // Removes the note at index, shifting the (few) notes in front of it.
+        void removeAt(size_t index) {
+            for (size_t i = index; i > 0; i--) {
+                hitTimes[slot(i)] = hitTimes[slot(i - 1)];
+            }
+            popFront();
+        }
+
+        void clear() {
+            head = 0;
+            count = 0;
+        }
+
+        // Number of leading notes whose hit time is before cutoff.
+        size_t countBefore(float cutoff) const {
+            const NoteKernels::Table& kernels = NoteKernels::best();
+            size_t firstCount = std::min(count, hitTimes.size() - head);
+            size_t expired = kernels.countBefore(hitTimes.data() + head, firstCount, cutoff);
+            if (expired == firstCount && firstCount < count) {
+                expired += kernels.countBefore(hitTimes.data(), count - firstCount, cutoff);
+            }
+            return expired;
+        }
+
+        // Writes the screen y of every note, in queue order, to outY.
+        void projectY(float songTime, float speed, float lineY, float* outY) const {
+            const NoteKernels::Table& kernels = NoteKernels::best();
+            size_t firstCount = std::min(count, hitTimes.size() - head);
+            kernels.projectY(hitTimes.data() + head, firstCount, songTime, speed, lineY, outY);
+            kernels.projectY(hitTimes.data(), count - firstCount, songTime, speed, lineY, outY + firstCount);
+        }
+
+        bool empty() const { return count == 0; }
+        size_t size() const { return count; }
+        float front() const { return hitTimes[head]; }
+        float at(size_t index) const { return hitTimes[slot(index)]; }
+    };
+
+enum class ProfileStage {
+    EVENTS,
+    UPDATE,
+    RENDER,
+    TEXT,  // part of RENDER
+    WAIT,
+    COUNT
+};
+
+const char* const PROFILE_STAGE_NAMES[] = {"events", "update", "render", "text", "wait"};
+
+// Accumulates per-stage frame timings from the performance counter and
+// prints averages every PROFILE_REPORT_FRAMES frames. Between beginRun()
+// and writeRunJson() it also keeps whole-run totals and a frame-time
+// histogram, for --benchmark.
+class FrameProfiler {
+    private:
+        Uint64 stageTicks[static_cast<int>(ProfileStage::COUNT)];
+        Uint64 intervalStart;
+        Uint64 lastFrameEnd;
+        float frameTimes[PROFILE_REPORT_FRAMES];  // ms, frame end to frame end
+        float sortedFrameTimes[PROFILE_REPORT_FRAMES];
+        int frames;
+        int totalFrames;
+        int drawCalls;
+        int textDrawCalls;
+        int glyphCount;
+        uint32_t audioUnderruns;
+        uint64_t droppedInputs;
+
+        Uint64 runStageTicks[static_cast<int>(ProfileStage::COUNT)];
+        uint32_t frameHistogram[FRAME_HISTOGRAM_BUCKETS];
+        int64_t runFrames;
+        double runFrameMsSum;
+        float runFrameMsMax;
+        int64_t runDrawCalls;
+        int64_t runGlyphs;
+
+        // Upper edge, in ms, of the bucket holding the p-th fraction of frames.
+        float runPercentile(double p) const {
+            int64_t rank = static_cast<int64_t>(p * runFrames);
+            int64_t seen = 0;
+            for (int i = 0; i < FRAME_HISTOGRAM_BUCKETS; i++) {
+                seen += frameHistogram[i];
+                if (seen > rank) {
+                    return (i + 1) * 0.01f;
+                }
+            }
+            return runFrameMsMax;
+        }
+
+    public:
+        // Times a block of code and charges it to one stage.
+        class Scope {
+            private:
+                FrameProfiler& profiler;
+                ProfileStage stage;
+                Uint64 start;
+
+            public:
+                Scope(FrameProfiler& owner, ProfileStage timed)
+                    : profiler(owner), stage(timed), start(SDL_GetPerformanceCounter()) {}
+
+                ~Scope() {
+                    Uint64 ticks = SDL_GetPerformanceCounter() - start;
+                    profiler.stageTicks[static_cast<int>(stage)] += ticks;
+                    profiler.runStageTicks[static_cast<int>(stage)] += ticks;
+                }
+            };
+
+        FrameProfiler() : lastFrameEnd(0), totalFrames(0), audioUnderruns(0), droppedInputs(0) {
+            reset();
+            beginRun();
+        }
+
+        void reset() {
+            for (Uint64& ticks : stageTicks) {
+                ticks = 0;
+            }
+            intervalStart = SDL_GetPerformanceCounter();
+            frames = 0;
+            drawCalls = 0;
+            textDrawCalls = 0;
+            glyphCount = 0;
+        }
+
+        void addDrawCalls(int count) {
+            drawCalls += count;
+            runDrawCalls += count;
+        }
+
+        void addTextBatch(int glyphs) {
+            drawCalls++;
+            textDrawCalls++;
+            glyphCount += glyphs;
+            runDrawCalls++;
+            runGlyphs += glyphs;
+        }
+
+        void beginRun() {
+            for (Uint64& ticks : runStageTicks) {
+                ticks = 0;
+            }
+            std::fill(frameHistogram, frameHistogram + FRAME_HISTOGRAM_BUCKETS, 0u);
+            runFrames = 0;
+            runFrameMsSum = 0.0;
+            runFrameMsMax = 0.0f;
+            runDrawCalls = 0;
+            runGlyphs = 0;
+        }
+
+        // Running total since the audio device was opened.
+        void setAudioUnderruns(uint32_t total) {
+            audioUnderruns = total;
+        }
+
+        // Running total of key events lost to a full input or press queue.
+        void setDroppedInputs(uint64_t total) {
+            droppedInputs = total;
+        }
+
+        void endFrame() {
+            Uint64 now = SDL_GetPerformanceCounter();
+            if (lastFrameEnd != 0) {
+                float frameMs = static_cast<float>((now - lastFrameEnd) * 1000.0 / SDL_GetPerformanceFrequency());
+                frameTimes[frames] = frameMs;
+                frameHistogram[std::min(FRAME_HISTOGRAM_BUCKETS - 1, static_cast<int>(frameMs * 100.0f))]++;
+                runFrames++;
+                runFrameMsSum += frameMs;
+                runFrameMsMax = std::max(runFrameMsMax, frameMs);
+            } else {
+                frameTimes[frames] = 0.0f;
+            }
+            lastFrameEnd = now;
+
+            frames++;
+            totalFrames++;
+            if (frames >= PROFILE_REPORT_FRAMES) {
+                report();
+                reset();
+            }
+        }
+
+        void report() {
+            double frequency = static_cast<double>(SDL_GetPerformanceFrequency());
+            double elapsed = (SDL_GetPerformanceCounter() - intervalStart) / frequency;
+
+            std::copy(frameTimes, frameTimes + frames, sortedFrameTimes);
+            std::sort(sortedFrameTimes, sortedFrameTimes + frames);
+            auto percentile = [&](float p) {
+                return sortedFrameTimes[std::min(frames - 1, static_cast<int>(p * frames))];
+            };
+
+            std::cout << "Frame " << totalFrames << ": " << (elapsed > 0.0 ? frames / elapsed : 0.0) << " fps"
+                      << " | frame ms p50 " << percentile(0.50f) << " p95 " << percentile(0.95f)
+                      << " p99 " << percentile(0.99f) << " max " << sortedFrameTimes[frames - 1];
+            for (int i = 0; i < static_cast<int>(ProfileStage::COUNT); i++) {
+                std::cout << " | " << PROFILE_STAGE_NAMES[i] << " "
+                          << stageTicks[i] * 1000.0 / frequency / frames << " ms";
+            }
+            std::cout << " | " << static_cast<double>(drawCalls) / frames << " draw calls"
+                      << " | text " << static_cast<double>(textDrawCalls) / frames << " draws, "
+                      << glyphCount / frames << " glyphs per frame"
+                      << " | " << audioUnderruns << " audio underruns"
+                      << " | " << droppedInputs << " dropped inputs" << std::endl;
+        }
+
+        int64_t getRunFrames() const { return runFrames; }
+
+        // The run so far as JSON object members, without the braces.
+        void writeRunJson(std::ostream& out, const char* indent) const {
+            double frequency = static_cast<double>(SDL_GetPerformanceFrequency());
+            double frameCount = static_cast<double>(std::max<int64_t>(runFrames, 1));
+
+            out << indent << "\"frames\": " << runFrames << ",\n";
+            out << indent << "\"frame_ms\": {\"mean\": " << runFrameMsSum / frameCount
+                << ", \"p50\": " << runPercentile(0.50) << ", \"p90\": " << runPercentile(0.90)
+                << ", \"p95\": " << runPercentile(0.95) << ", \"p99\": " << runPercentile(0.99)
+                << ", \"p99_9\": " << runPercentile(0.999) << ", \"max\": " << runFrameMsMax << "},\n";
+            out << indent << "\"stage_ms_per_frame\": {";
+            for (int i = 0; i < static_cast<int>(ProfileStage::COUNT); i++) {
+                out << (i > 0 ? ", " : "") << "\"" << PROFILE_STAGE_NAMES[i] << "\": "
+                    << runStageTicks[i] * 1000.0 / frequency / frameCount;
+            }
+            out << "},\n";
+            out << indent << "\"draw_calls_per_frame\": " << runDrawCalls / frameCount << ",\n";
+            out << indent << "\"glyphs_per_frame\": " << runGlyphs / frameCount << ",\n";
+            out << indent << "\"audio_underruns\": " << audioUnderruns;
+        }
+    };
+
+// Bounded single-producer/single-consumer queue. push() and pop() never block
+// or allocate, so either side can run on its own thread.
+template <typename T, size_t Capacity>
+class SpscQueue {
+    private:
+        static_assert((Capacity & (Capacity - 1)) == 0, "SpscQueue capacity must be a power of two");
+
+        T items[Capacity];
+        alignas(64) std::atomic<size_t> head;  // next slot to read, owned by the consumer
+        alignas(64) std::atomic<size_t> tail;  // next slot to write, owned by the producer
+
+    public:
+        SpscQueue() : head(0), tail(0) {}
+
+        bool push(const T& item) {
+            size_t writeIndex = tail.load(std::memory_order_relaxed);
+            if (writeIndex - head.load(std::memory_order_acquire) == Capacity) {
+                return false;
+            }
+            items[writeIndex & (Capacity - 1)] = item;
+            tail.store(writeIndex + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool peek(T& item) const {
+            size_t readIndex = head.load(std::memory_order_relaxed);
+            if (readIndex == tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+            item = items[readIndex & (Capacity - 1)];
+            return true;
+        }
+
+        bool pop(T& item) {
+            if (!peek(item)) {
+                return false;
+            }
+            head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Producer side only. A queue that is not full stays that way until
+        // the next push.
+        bool full() const {
+            return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) == Capacity;
+        }
+
+        // Consumer side only.
+        void clear() {
+            head.store(tail.load(std::memory_order_acquire), std::memory_order_release);
+        }
+    };
+
+// An SDL event stamped with the performance counter when it was polled.
+struct TimedEvent {
+    SDL_Event event;
+    Uint64 timestamp;
+};
+
+// A column key going down, waiting to be judged by the simulation.
+struct ColumnPress {
+    int column;
+    double time;  // game time of the press
+};
+
+enum class FramePacing {
+    CAPPED,    // FrameLimiter holds a target rate
+    VSYNC,     // presentation blocks on the display's refresh
+    UNCAPPED
+};
+
+// Holds frames to a fixed rate against performance-counter deadlines. Most
+// of the wait is slept with SDL_Delay; the last FRAME_SPIN_MS are spun so the
+// deadline is met regardless of the OS timer granularity. A frame that runs
+// long starts a new schedule instead of being followed by a burst. The idle
+// callback runs about every millisecond while waiting, which is how input keeps
+// being sampled between frames.
+class FrameLimiter {
+    private:
+        Uint64 frequency;
+        Uint64 period;
+        Uint64 deadline;
+
+    public:
+        FrameLimiter() : frequency(SDL_GetPerformanceFrequency()), period(0), deadline(0) {}
+
+        // 0 disables limiting.
+        void setTargetFps(int fps) {
+            period = fps > 0 ? frequency / fps : 0;
+            deadline = 0;
+        }
+
+        template <typename IdleFn>
+        void wait(IdleFn idle) {
+            if (period == 0) return;
+
+            Uint64 now = SDL_GetPerformanceCounter();
+            if (deadline == 0) {
+                deadline = now;
+            }
+            deadline += period;
+            if (now >= deadline) {
+                deadline = now;
+                return;
+            }
+
+            Uint64 spinTicks = frequency * FRAME_SPIN_MS / 1000;
+            Uint64 idleInterval = frequency * INPUT_POLL_INTERVAL_US / 1000000;
+            Uint64 lastIdle = now;
+            while (now < deadline) {
+                if (deadline - now > spinTicks) {
+                    SDL_Delay(1);
+                    idle();
+                    lastIdle = SDL_GetPerformanceCounter();
+                } else if (now - lastIdle >= idleInterval) {
+                    idle();
+                    lastIdle = SDL_GetPerformanceCounter();
+                }
+                now = SDL_GetPerformanceCounter();
+            }
+        }
+    };
+
+// Game time locked to the audio device. SDL_mixer's post-mix callback counts
+// every sample frame handed to the device, and the mixer position at the
+// start of the latest buffer is extrapolated with the performance counter
+// until the next callback. The game reads a performance-counter clock that is
+// slewed toward that position a little each frame, so it stays smooth between
+// callbacks yet cannot wander from the music however long the song is; drift
+// past CLOCK_SNAP_THRESHOLD (a stall or a late start) is corrected at once.
+// A buffer is heard one buffer after it is mixed, so the device position is
+// taken that far behind the mixer. The same callback times the gaps between
+// buffers to count underruns.
+class SongClock {
+    private:
+        // Written by the audio thread under a sequence lock.
+        std::atomic<uint32_t> sequence;
+        std::atomic<uint64_t> mixedFrames;   // frames mixed before the latest buffer
+        std::atomic<uint64_t> mixCounter;    // performance counter at the latest callback
+        std::atomic<uint32_t> bufferFrames;  // length of the latest buffer
+        std::atomic<uint64_t> totalFrames;   // frames mixed including the latest buffer
+        std::atomic<uint32_t> underruns;
+        int frameBytes;
+        int frequency;
+        int channels;
+
+        Uint64 counterFrequency;
+        Uint64 startCounter;
+        uint64_t startFrames;
+        bool followingAudio;
+        double correction;  // seconds added to the performance-counter time
+
+        int driftSamples;
+        double driftAbsSum;
+        double maxDrift;
+        int snapCount;
+
+        static void SDLCALL postMix(void* userdata, Uint8* stream, int length) {
+            (void)stream;
+            SongClock* clock = static_cast<SongClock*>(userdata);
+            uint32_t frames = static_cast<uint32_t>(length / clock->frameBytes);
+            uint64_t before = clock->totalFrames.load(std::memory_order_relaxed);
+            Uint64 now = SDL_GetPerformanceCounter();
+            Uint64 previous = clock->mixCounter.load(std::memory_order_relaxed);
+            if (previous != 0 && frames > 0 &&
+                now - previous > AUDIO_UNDERRUN_GAP * frames * clock->counterFrequency / clock->frequency) {
+                clock->underruns.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            uint32_t seq = clock->sequence.load(std::memory_order_relaxed);
+            clock->sequence.store(seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            clock->mixedFrames.store(before, std::memory_order_relaxed);
+            clock->mixCounter.store(now, std::memory_order_relaxed);
+            clock->bufferFrames.store(frames, std::memory_order_relaxed);
+            clock->totalFrames.store(before + frames, std::memory_order_relaxed);
+            clock->sequence.store(seq + 2, std::memory_order_release);
+        }
+
+        bool readMixPosition(uint64_t& frames, Uint64& counter, uint32_t& buffer) const {
+            for (int attempt = 0; attempt < 64; attempt++) {
+                uint32_t seq = sequence.load(std::memory_order_acquire);
+                if (seq & 1) continue;
+                frames = mixedFrames.load(std::memory_order_relaxed);
+                counter = mixCounter.load(std::memory_order_relaxed);
+                buffer = bufferFrames.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sequence.load(std::memory_order_relaxed) == seq) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    public:
+        SongClock() :
+            sequence(0), mixedFrames(0), mixCounter(0), bufferFrames(0), totalFrames(0), underruns(0),
+            frameBytes(4), frequency(AUDIO_FREQUENCY), channels(AUDIO_CHANNELS),
+            counterFrequency(SDL_GetPerformanceFrequency()), startCounter(0), startFrames(0),
+            followingAudio(false), correction(0.0),
+            driftSamples(0), driftAbsSum(0.0), maxDrift(0.0), snapCount(0) {}
+
+        // Call each time the audio device is opened.
+        bool attach() {
+            Uint16 format = 0;
+            if (Mix_QuerySpec(&frequency, &format, &channels) == 0) {
+                std::cerr << "Could not query audio format! Mix_Error: " << Mix_GetError() << std::endl;
+                return false;
+            }
+            frameBytes = std::max(1, static_cast<int>(SDL_AUDIO_BITSIZE(format) / 8) * channels);
+            mixCounter.store(0, std::memory_order_relaxed);
+            bufferFrames.store(0, std::memory_order_relaxed);
+            underruns.store(0, std::memory_order_relaxed);
+            Mix_SetPostMix(&SongClock::postMix, this);
+            return true;
+        }
+
+        void detach() {
+            Mix_SetPostMix(nullptr, nullptr);
+            followingAudio = false;
+        }
+
+        // Time 0 is `counter`. With followAudio set, it is also the first
+        // sample of music queued after this call.
+        void start(Uint64 counter, bool followAudio) {
+            startCounter = counter;
+            startFrames = totalFrames.load(std::memory_order_acquire);
+            followingAudio = followAudio;
+            correction = 0.0;
+            driftSamples = 0;
+            driftAbsSum = 0.0;
+            maxDrift = 0.0;
+            snapCount = 0;
+        }
+
+        // Keeps running on the performance counter alone, e.g. once the music ends.
+        void stopFollowingAudio() {
+            followingAudio = false;
+        }
+
+        double getTime(Uint64 counter) const {
+            return static_cast<double>(static_cast<int64_t>(counter - startCounter)) / counterFrequency + correction;
+        }
+
+        // Inverse of getTime() under the current correction.
+        Uint64 getCounterAtTime(double time) const {
+            return startCounter + static_cast<Uint64>(static_cast<int64_t>(std::llround((time - correction) * counterFrequency)));
+        }
+
+        // Playback position at the device output, extrapolated to `now`.
+        bool getAudioTime(Uint64 now, double& time) const {
+            uint64_t frames;
+            Uint64 counter;
+            uint32_t buffer;
+            if (!readMixPosition(frames, counter, buffer) || frames < startFrames || counter == 0) {
+                return false;
+            }
+            double sinceMix = static_cast<double>(static_cast<int64_t>(now - counter)) / counterFrequency;
+            sinceMix = std::min(std::max(sinceMix, 0.0), static_cast<double>(buffer) / frequency);
+            time = (static_cast<double>(frames - startFrames) - buffer) / frequency + sinceMix;
+            return true;
+        }
+
+        // Once per frame: measures drift against the device and corrects it.
+        void update(Uint64 now) {
+            double audioTime;
+            if (!followingAudio || !getAudioTime(now, audioTime)) {
+                return;
+            }
+
+            double drift = audioTime - getTime(now);
+            driftSamples++;
+            driftAbsSum += std::abs(drift);
+            maxDrift = std::max(maxDrift, std::abs(drift));
+
+            if (std::abs(drift) > CLOCK_SNAP_THRESHOLD) {
+                correction += drift;
+                snapCount++;
+            } else {
+                correction += drift * CLOCK_SLEW_RATE;
+            }
+        }
+
+        // Mixer frame being mixed at performance-counter time `counter`,
+        // extrapolated from the latest callback.
+        uint64_t getFrameAtCounter(Uint64 counter) const {
+            uint64_t frames;
+            Uint64 mixed;
+            uint32_t buffer;
+            if (!readMixPosition(frames, mixed, buffer) || mixed == 0) {
+                return getMixedFrames();
+            }
+            double elapsed = static_cast<double>(static_cast<int64_t>(counter - mixed)) * frequency / counterFrequency;
+            return static_cast<uint64_t>(std::max(0.0, static_cast<double>(frames) + elapsed));
+        }
+
+        // Mixer frame heard at game time `time`, plus one buffer: the frame
+        // being mixed at that moment.
+        uint64_t getMixerFrameAtTime(double time) const {
+            double frame = static_cast<double>(startFrames) + getBufferFrames() + time * frequency;
+            return static_cast<uint64_t>(std::max(0.0, frame));
+        }
+
+        // First mixer frame of the current play.
+        uint64_t getStartFrame() const { return startFrames; }
+
+        // Frames mixed so far; a sound started now begins at this frame.
+        uint64_t getMixedFrames() const { return totalFrames.load(std::memory_order_acquire); }
+
+        // Performance-counter time at which mixer frame `frame` reaches the
+        // device output. False until the buffer holding it has been mixed.
+        bool getOutputCounter(uint64_t frame, Uint64& counter) const {
+            uint64_t frames;
+            Uint64 mixed;
+            uint32_t buffer;
+            if (!readMixPosition(frames, mixed, buffer) || mixed == 0 || frame >= frames + buffer) {
+                return false;
+            }
+            double framesAhead = static_cast<double>(static_cast<int64_t>(frame - frames)) + buffer;
+            counter = mixed + static_cast<Uint64>(static_cast<int64_t>(framesAhead * counterFrequency / frequency));
+            return true;
+        }
+
+        int getFrequency() const { return frequency; }
+        int getChannels() const { return channels; }
+        // Device buffer as seen by the mixer; 0 until the first callback.
+        uint32_t getBufferFrames() const { return bufferFrames.load(std::memory_order_relaxed); }
+        double getOutputLatency() const { return static_cast<double>(getBufferFrames()) / frequency; }
+        uint32_t getUnderruns() const { return underruns.load(std::memory_order_relaxed); }
+        double getMeanDrift() const { return driftSamples > 0 ? driftAbsSum / driftSamples : 0.0; }
+        double getMaxDrift() const { return maxDrift; }
+        int getSnapCount() const { return snapCount; }
+    };
+
+// Mixing kernels over interleaved float samples, in scalar, SSE and AVX
+// versions picked the same way as NoteKernels.
+//   mixAdd: out[i] += in[i] * gain
+//   clip:   clamp to [-1, 1]
+namespace MixKernels {
+    void mixAddScalar(float* out, const float* in, size_t count, float gain) {
+        for (size_t i = 0; i < count; i++) {
+            out[i] += in[i] * gain;
+        }
+    }
+
+    void clipScalar(float* samples, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            samples[i] = std::min(1.0f, std::max(-1.0f, samples[i]));
+        }
+    }
+
+#if NOTE_KERNELS_X86
+    void mixAddSse(float* out, const float* in, size_t count, float gain) {
+        const __m128 gainVec = _mm_set1_ps(gain);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128 scaled = _mm_mul_ps(_mm_loadu_ps(in + i), gainVec);
+            _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), scaled));
+        }
+        mixAddScalar(out + i, in + i, count - i, gain);
+    }
+
+    void clipSse(float* samples, size_t count) {
+        const __m128 low = _mm_set1_ps(-1.0f);
+        const __m128 high = _mm_set1_ps(1.0f);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            _mm_storeu_ps(samples + i, _mm_min_ps(high, _mm_max_ps(low, _mm_loadu_ps(samples + i))));
+        }
+        clipScalar(samples + i, count - i);
+    }
+
+    __attribute__((target("avx")))
+    void mixAddAvx(float* out, const float* in, size_t count, float gain) {
+        const __m256 gainVec = _mm256_set1_ps(gain);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256 scaled = _mm256_mul_ps(_mm256_loadu_ps(in + i), gainVec);
+            _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), scaled));
+        }
+        mixAddScalar(out + i, in + i, count - i, gain);
+    }
+
+    __attribute__((target("avx")))
+    void clipAvx(float* samples, size_t count) {
+        const __m256 low = _mm256_set1_ps(-1.0f);
+        const __m256 high = _mm256_set1_ps(1.0f);
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            _mm256_storeu_ps(samples + i, _mm256_min_ps(high, _mm256_max_ps(low, _mm256_loadu_ps(samples + i))));
+        }
+        clipScalar(samples + i, count - i);
+    }
+#endif
+
+    struct Table {
+        const char* name;
+        void (*mixAdd)(float*, const float*, size_t, float);
+        void (*clip)(float*, size_t);
+    };
+
+    const Table SCALAR = {"scalar", mixAddScalar, clipScalar};
+#if NOTE_KERNELS_X86
+    const Table SSE = {"sse", mixAddSse, clipSse};
+    const Table AVX = {"avx", mixAddAvx, clipAvx};
+#endif
+
+    const Table& best() {
+        static const Table& table =
+#if NOTE_KERNELS_X86
+            SDL_HasAVX() ? AVX : SDL_HasSSE() ? SSE :
+#endif
+            SCALAR;
+        return table;
+    }
+}
+
+// Starts (or, with no samples, stops) a mixer voice. `startFrame` is on the
+// song clock's mixer-frame timeline.
+struct MixerCommand {
+    int voice;
+    const float* samples;  // interleaved, device channel count
+    uint64_t length;       // frames
+    uint64_t startFrame;
+    float gain;
+};
+
+// The game's own mixer. It is installed with Mix_HookMusic, so it runs first
+// in SDL_mixer's audio callback and writes the float device stream directly;
+// SDL_mixer's music and channels are left idle. A voice plays decoded frames
+// from an exact mixer frame, so a start can land anywhere inside a buffer,
+// and a start that arrives late is skipped forward rather than shifted. The
+// game thread chooses voices and sends commands through a lock-free queue;
+// the callback never locks or allocates.
+class SoftwareMixer {
+    private:
+        struct Voice {
+            const float* samples;
+            uint64_t length;
+            uint64_t startFrame;
+            float gain;
+            bool active;
+        };
+
+        Voice voices[MIXER_VOICES];
+        SpscQueue<MixerCommand, MIXER_COMMAND_CAPACITY> commands;
+        const MixKernels::Table* kernels;
+        const SongClock* clock;
+        int channels;
+
+        static void SDLCALL callback(void* userdata, Uint8* stream, int length) {
+            SoftwareMixer* mixer = static_cast<SoftwareMixer*>(userdata);
+            int frames = length / static_cast<int>(sizeof(float) * mixer->channels);
+            mixer->mix(reinterpret_cast<float*>(stream), frames, mixer->clock->getMixedFrames());
+        }
+
+        void stopAll() {
+            for (Voice& voice : voices) {
+                voice.active = false;
+            }
+            MixerCommand command;
+            while (commands.pop(command)) {}
+        }
+
+        void applyCommands() {
+            MixerCommand command;
+            while (commands.pop(command)) {
+                Voice& voice = voices[command.voice];
+                voice.samples = command.samples;
+                voice.length = command.length;
+                voice.startFrame = command.startFrame;
+                voice.gain = command.gain;
+                voice.active = command.samples != nullptr;
+            }
+        }
+
+    public:
+        SoftwareMixer() : kernels(&MixKernels::best()), clock(nullptr), channels(AUDIO_CHANNELS) {
+            stopAll();
+        }
+
+        // Call after the song clock is attached. The device must be float.
+        bool attach(const SongClock& songClock) {
+            int frequency = 0;
+            Uint16 format = 0;
+            if (Mix_QuerySpec(&frequency, &format, &channels) == 0 || format != AUDIO_F32SYS) {
+                std::cerr << "Mixer needs a float audio device" << std::endl;
+                return false;
+            }
+            clock = &songClock;
+            stopAll();
+            Mix_HookMusic(&SoftwareMixer::callback, this);
+            return true;
+        }
+
+        void detach() {
+            Mix_HookMusic(nullptr, nullptr);
+            clock = nullptr;
+            stopAll();
+        }
+
+        // Stops voices [first, first + count) before returning, rather than
+        // at the next callback like stop(), so their samples can be freed
+        // straight after. Mix_HookMusic takes the audio device lock, so no
+        // callback runs while the hook is off; commands already queued for
+        // other voices are applied, not lost.
+        void stopNow(int first, int count) {
+            if (clock != nullptr) {
+                Mix_HookMusic(nullptr, nullptr);
+            }
+            applyCommands();
+            for (int i = first; i < first + count; i++) {
+                voices[i].active = false;
+            }
+            if (clock != nullptr) {
+                Mix_HookMusic(&SoftwareMixer::callback, this);
+            }
+        }
+
+        bool play(int voice, const float* samples, uint64_t length, uint64_t startFrame, float gain) {
+            MixerCommand command = {voice, samples, length, startFrame, gain};
+            return commands.push(command);
+        }
+
+        bool stop(int voice) {
+            MixerCommand command = {voice, nullptr, 0, 0, 0.0f};
+            return commands.push(command);
+        }
+
+        void setChannels(int count) { channels = count; }
+        int getChannels() const { return channels; }
+        void setKernels(const MixKernels::Table& table) { kernels = &table; }
+
+        // Fills `frames` frames starting at mixer frame `bufferStart`.
+        void mix(float* out, int frames, uint64_t bufferStart) {
+            applyCommands();
+
+            std::fill(out, out + static_cast<size_t>(frames) * channels, 0.0f);
+
+            uint64_t bufferEnd = bufferStart + frames;
+            for (Voice& voice : voices) {
+                if (!voice.active || voice.startFrame >= bufferEnd) continue;
+
+                uint64_t offset = voice.startFrame > bufferStart ? voice.startFrame - bufferStart : 0;
+                uint64_t position = bufferStart + offset - voice.startFrame;
+                if (position >= voice.length) {
+                    voice.active = false;
+                    continue;
+                }
+
+                uint64_t count = std::min<uint64_t>(frames - offset, voice.length - position);
+                kernels->mixAdd(out + offset * channels, voice.samples + position * channels,
+                                static_cast<size_t>(count * channels), voice.gain);
+                if (position + count >= voice.length) {
+                    voice.active = false;
+                }
+            }
+
+            kernels->clip(out, static_cast<size_t>(frames) * channels);
+        }
+    };
+
+// Hitsound played on every column key press. The sample is decoded once per
+// device open into a Mix_Chunk in the device format and played on
+// HITSOUND_VOICES mixer voices taken round-robin, so a fast stream of hits
+// steals the oldest voice rather than being dropped. play() does no file I/O
+// and no allocation. Each hit starts one device buffer after its key press
+// on the mixer timeline, so key-to-sound latency does not depend on where
+// the press fell within a buffer. That latency is measured by asking the
+// song clock when the first frame of each voice reaches the device output.
+class HitsoundPool {
+    private:
+        struct PendingVoice {
+            uint64_t startFrame;
+            Uint64 keyCounter;
+        };
+
+        Mix_Chunk* chunk;
+        uint64_t chunkFrames;
+        int nextVoice;
+        PendingVoice pending[HITSOUND_LATENCY_SLOTS];
+        int pendingHead;
+        int pendingCount;
+        int latencySamples;
+        double latencySum;
+        double latencyMax;
+
+        // A short decaying click as a 16-bit mono WAV, used when no hitsound
+        // file is present. SDL_mixer converts it to the device format.
+        static std::vector<uint8_t> synthesizeClick() {
+            const int rate = 44100;
+            const int frames = rate * 40 / 1000;
+            const uint32_t dataBytes = frames * 2;
+            std::vector<uint8_t> wav(44 + dataBytes);
+            uint8_t* out = wav.data();
+            auto put32 = [&out](uint32_t v) { for (int i = 0; i < 4; i++) *out++ = static_cast<uint8_t>(v >> (i * 8)); };
+            auto put16 = [&out](uint16_t v) { *out++ = static_cast<uint8_t>(v); *out++ = static_cast<uint8_t>(v >> 8); };
+            auto tag = [&out](const char* t) { std::memcpy(out, t, 4); out += 4; };
+
+            tag("RIFF"); put32(36 + dataBytes); tag("WAVE");
+            tag("fmt "); put32(16); put16(1); put16(1); put32(rate); put32(rate * 2); put16(2); put16(16);
+            tag("data"); put32(dataBytes);
+
+            uint32_t noise = 0x12345678u;
+            for (int i = 0; i < frames; i++) {
+                float t = static_cast<float>(i) / rate;
+                noise = noise * 1664525u + 1013904223u;
+                float tone = std::sin(2.0f * 3.14159265f * 1800.0f * t) * std::exp(-t / 0.008f);
+                float click = (static_cast<float>(noise >> 16) / 32768.0f - 1.0f) * std::exp(-t / 0.002f);
+                float sample = std::max(-1.0f, std::min(1.0f, 0.6f * tone + 0.3f * click));
+                put16(static_cast<uint16_t>(static_cast<int16_t>(sample * 32767.0f)));
+            }
+            return wav;
+        }
+
+    public:
+        HitsoundPool() : chunk(nullptr), chunkFrames(0), nextVoice(0), pendingHead(0), pendingCount(0) {
+            resetLatency();
+        }
+
+        // Call after the audio device is opened.
+        bool load(int channels) {
+            unload();
+
+            chunk = Mix_LoadWAV(HITSOUND_FILE);
+            if (chunk == nullptr) {
+                std::vector<uint8_t> wav = synthesizeClick();
+                chunk = Mix_LoadWAV_RW(SDL_RWFromConstMem(wav.data(), static_cast<int>(wav.size())), 1);
+            }
+            if (chunk == nullptr) {
+                std::cerr << "Failed to load hitsound! Mix_Error: " << Mix_GetError() << std::endl;
+                return false;
+            }
+            chunkFrames = chunk->alen / (sizeof(float) * channels);
+            nextVoice = 0;
+            return true;
+        }
+
+        // Call once the mixer no longer plays it.
+        void unload() {
+            if (chunk != nullptr) {
+                Mix_FreeChunk(chunk);
+                chunk = nullptr;
+            }
+            pendingCount = 0;
+        }
+
+        void play(Uint64 keyCounter, const SongClock& clock, SoftwareMixer& mixer) {
+            if (chunk == nullptr) return;
+
+            uint64_t startFrame = std::max(clock.getFrameAtCounter(keyCounter) + clock.getBufferFrames(),
+                                           clock.getMixedFrames());
+            mixer.play(FIRST_HITSOUND_VOICE + nextVoice, reinterpret_cast<const float*>(chunk->abuf),
+                       chunkFrames, startFrame, HITSOUND_GAIN);
+            nextVoice = (nextVoice + 1) % HITSOUND_VOICES;
+
+            if (pendingCount == HITSOUND_LATENCY_SLOTS) {
+                pendingHead = (pendingHead + 1) % HITSOUND_LATENCY_SLOTS;
+                pendingCount--;
+            }
+            pending[(pendingHead + pendingCount) % HITSOUND_LATENCY_SLOTS] = {startFrame, keyCounter};
+            pendingCount++;
+        }
+
+        // Once per frame: voices that have been mixed by now get their
+        // output time, and so their latency from the key press.
+        void measureLatency(const SongClock& clock) {
+            double counterFrequency = static_cast<double>(SDL_GetPerformanceFrequency());
+            while (pendingCount > 0) {
+                const PendingVoice& voice = pending[pendingHead];
+                Uint64 outputCounter;
+                if (!clock.getOutputCounter(voice.startFrame, outputCounter)) {
+                    break;
+                }
+
+                double latency = static_cast<double>(static_cast<int64_t>(outputCounter - voice.keyCounter)) / counterFrequency;
+                latencySamples++;
+                latencySum += latency;
+                latencyMax = std::max(latencyMax, latency);
+
+                pendingHead = (pendingHead + 1) % HITSOUND_LATENCY_SLOTS;
+                pendingCount--;
+            }
+        }
+
+        void resetLatency() {
+            latencySamples = 0;
+            latencySum = 0.0;
+            latencyMax = 0.0;
+        }
+
+        int getLatencySamples() const { return latencySamples; }
+        double getMeanLatency() const { return latencySamples > 0 ? latencySum / latencySamples : 0.0; }
+        double getMaxLatency() const { return latencyMax; }
+    };
+
+// Hands out mixer voices from a fixed range. An idle voice is used when there
+// is one; otherwise the voice that started earliest is stolen, so polyphony
+// never exceeds the range however dense the chart is.
+class VoiceAllocator {
+    private:
+        int firstVoice;
+        uint64_t voiceEnds[KEYSOUND_VOICES];
+        uint64_t voiceStarts[KEYSOUND_VOICES];
+        uint64_t steals;
+
+    public:
+        explicit VoiceAllocator(int first) : firstVoice(first), steals(0) {
+            reset();
+        }
+
+        void reset() {
+            for (int i = 0; i < KEYSOUND_VOICES; i++) {
+                voiceEnds[i] = 0;
+                voiceStarts[i] = 0;
+            }
+        }
+
+        // `now` is the first frame not yet mixed.
+        int allocate(uint64_t start, uint64_t end, uint64_t now) {
+            int chosen = 0;
+            for (int i = 0; i < KEYSOUND_VOICES; i++) {
+                if (voiceEnds[i] <= now) {
+                    chosen = i;
+                    break;
+                }
+                if (voiceStarts[i] < voiceStarts[chosen]) {
+                    chosen = i;
+                }
+                if (i == KEYSOUND_VOICES - 1) {
+                    steals++;
+                }
+            }
+            voiceStarts[chosen] = start;
+            voiceEnds[chosen] = end;
+            return firstVoice + chosen;
+        }
+
+        uint64_t getSteals() const { return steals; }
+    };
+
+// Decoded keysounds for the current chart, held under a memory budget. A
+// worker thread decodes every sample needed within KEYSOUND_LOOKAHEAD seconds
+// of the playhead; once the budget is exceeded the least recently used
+// samples that no voice is still playing are freed. The play path never
+// waits on the worker: a sample that is not decoded in time is skipped and
+// counted instead.
+class KeysoundCache {
+    private:
+        enum State : uint8_t { EMPTY, QUEUED, READY, FAILED };
+
+        struct Entry {
+            std::atomic<uint8_t> state;
+            Mix_Chunk* chunk;    // written by the worker before state becomes READY
+            uint64_t busyUntil;  // mixer frame at which its last voice ends
+            int lruPrev;
+            int lruNext;
+        };
+
+        std::unique_ptr<Entry[]> entries;
+        std::vector<std::string> paths;
+        int entryCount;
+        int lruHead;  // least recently used
+        int lruTail;
+        size_t prefetchCursor;
+        size_t budgetBytes;
+        std::atomic<size_t> residentBytes;
+        int channels;
+        uint64_t lateSamples;
+        uint64_t evictions;
+
+        SpscQueue<uint32_t, KEYSOUND_REQUEST_CAPACITY> requests;
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping;
+
+        void unlink(int id) {
+            Entry& entry = entries[id];
+            if (entry.lruPrev >= 0) entries[entry.lruPrev].lruNext = entry.lruNext; else lruHead = entry.lruNext;
+            if (entry.lruNext >= 0) entries[entry.lruNext].lruPrev = entry.lruPrev; else lruTail = entry.lruPrev;
+        }
+
+        void touch(int id) {
+            if (lruTail == id) return;
+            unlink(id);
+            Entry& entry = entries[id];
+            entry.lruPrev = lruTail;
+            entry.lruNext = -1;
+            if (lruTail >= 0) entries[lruTail].lruNext = id; else lruHead = id;
+            lruTail = id;
+        }
+
+        void decodeLoop() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                uint32_t id;
+                wake.wait(lock, [this, &id]() { return stopping || requests.peek(id); });
+                if (stopping) return;
+                requests.pop(id);
+
+                lock.unlock();
+                Mix_Chunk* chunk = Mix_LoadWAV(paths[id].c_str());
+                Entry& entry = entries[id];
+                if (chunk != nullptr) {
+                    entry.chunk = chunk;
+                    residentBytes.fetch_add(chunk->alen, std::memory_order_relaxed);
+                    entry.state.store(READY, std::memory_order_release);
+                } else {
+                    std::cerr << "Failed to load keysound " << paths[id] << "! Mix_Error: " << Mix_GetError() << std::endl;
+                    entry.state.store(FAILED, std::memory_order_release);
+                }
+                lock.lock();
+            }
+        }
+
+        void evict(uint64_t mixedFrames) {
+            int id = lruHead;
+            while (id >= 0 && residentBytes.load(std::memory_order_relaxed) > budgetBytes) {
+                Entry& entry = entries[id];
+                int next = entry.lruNext;
+                if (entry.state.load(std::memory_order_acquire) == READY && entry.busyUntil <= mixedFrames) {
+                    residentBytes.fetch_sub(entry.chunk->alen, std::memory_order_relaxed);
+                    Mix_FreeChunk(entry.chunk);
+                    entry.chunk = nullptr;
+                    entry.state.store(EMPTY, std::memory_order_relaxed);
+                    evictions++;
+                }
+                id = next;
+            }
+        }
+
+    public:
+        KeysoundCache() : entryCount(0), lruHead(-1), lruTail(-1), prefetchCursor(0),
+                          budgetBytes(static_cast<size_t>(DEFAULT_KEYSOUND_BUDGET_MB) << 20),
+                          residentBytes(0), channels(AUDIO_CHANNELS), lateSamples(0), evictions(0),
+                          stopping(false) {}
+
+        ~KeysoundCache() {
+            stop();
+        }
+
+        void setBudget(size_t bytes) { budgetBytes = bytes; }
+
+        // Takes the sample table of `beatmap`, whose sample names are relative
+        // to `directory`, and starts the decode worker. Call with the audio
+        // device open.
+        void start(const Beatmap& beatmap, const std::string& directory, int deviceChannels) {
+            stop();
+
+            entryCount = static_cast<int>(beatmap.getSampleCount());
+            if (entryCount == 0) return;
+
+            channels = deviceChannels;
+            paths.resize(entryCount);
+            entries.reset(new Entry[entryCount]);
+            for (int i = 0; i < entryCount; i++) {
+                paths[i] = (std::filesystem::path(directory) / beatmap.getSampleName(i)).string();
+                Entry& entry = entries[i];
+                entry.state.store(EMPTY, std::memory_order_relaxed);
+                entry.chunk = nullptr;
+                entry.busyUntil = 0;
+                entry.lruPrev = i - 1;
+                entry.lruNext = i + 1 < entryCount ? i + 1 : -1;
+            }
+            lruHead = 0;
+            lruTail = entryCount - 1;
+            prefetchCursor = 0;
+
+            stopping = false;
+            worker = std::thread(&KeysoundCache::decodeLoop, this);
+        }
+
+        // Joins the worker and frees every sample. The mixer must not be playing any.
+        void stop() {
+            if (worker.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+                wake.notify_one();
+                worker.join();
+            }
+
+            for (int i = 0; i < entryCount; i++) {
+                if (entries[i].chunk != nullptr) {
+                    Mix_FreeChunk(entries[i].chunk);
+                }
+            }
+            uint32_t id;
+            while (requests.pop(id)) {}
+            entries.reset();
+            paths.clear();
+            entryCount = 0;
+            lruHead = -1;
+            lruTail = -1;
+            residentBytes.store(0, std::memory_order_relaxed);
+        }
+
+        // Back to the start of the chart. Decoded samples are kept.
+        void rewind() {
+            prefetchCursor = 0;
+            lateSamples = 0;
+        }
+
+        // Once per frame: queues samples coming up within the lookahead and
+        // frees old ones if over budget.
+        void prefetch(const Beatmap& beatmap, float songTime, uint64_t mixedFrames) {
+            if (entryCount == 0 || beatmap.getNoteSamples() == nullptr) return;
+
+            const float* times = beatmap.getNoteTimes();
+            const uint16_t* samples = beatmap.getNoteSamples();
+            bool queued = false;
+            while (prefetchCursor < beatmap.getNoteCount() &&
+                   times[prefetchCursor] <= songTime + KEYSOUND_LOOKAHEAD) {
+                uint16_t id = samples[prefetchCursor];
+                if (id != NO_SAMPLE) {
+                    Entry& entry = entries[id];
+                    if (entry.state.load(std::memory_order_acquire) == EMPTY) {
+                        entry.state.store(QUEUED, std::memory_order_relaxed);
+                        if (!requests.push(id)) {
+                            entry.state.store(EMPTY, std::memory_order_relaxed);
+                            break;
+                        }
+                        queued = true;
+                    }
+                    touch(id);
+                }
+                prefetchCursor++;
+            }
+
+            if (queued) {
+                std::lock_guard<std::mutex> lock(mutex);
+                wake.notify_one();
+            }
+            evict(mixedFrames);
+        }
+
+        // Starts sample `id` at mixer frame `startFrame` on a voice from `voices`.
+        void play(uint16_t id, uint64_t startFrame, uint64_t mixedFrames, SoftwareMixer& mixer, VoiceAllocator& voices) {
+            if (id == NO_SAMPLE || id >= entryCount) return;
+
+            Entry& entry = entries[id];
+            if (entry.state.load(std::memory_order_acquire) != READY) {
+                lateSamples++;
+                return;
+            }
+
+            uint64_t frames = entry.chunk->alen / (sizeof(float) * channels);
+            entry.busyUntil = std::max(entry.busyUntil, startFrame + frames);
+            touch(id);
+            int voice = voices.allocate(startFrame, startFrame + frames, mixedFrames);
+            mixer.play(voice, reinterpret_cast<const float*>(entry.chunk->abuf), frames, startFrame, KEYSOUND_GAIN);
+        }
+
+        bool empty() const { return entryCount == 0; }
+        size_t getResidentBytes() const { return residentBytes.load(std::memory_order_relaxed); }
+        uint64_t getLateSamples() const { return lateSamples; }
+        uint64_t getEvictions() const { return evictions; }
+    };
+
+// 64-bit FNV-1a, used to key cached files by the content they came from.
+// Pass an earlier result as `hash` to continue hashing after it.
+uint64_t fnv1a64(const unsigned char* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// On-disk layout of a decoded music track:
+//   PcmCacheHeader
+//   float frames[frameCount * channels]  (interleaved, device rate)
+const char PCM_CACHE_MAGIC[4] = {'O', 'M', 'P', 'C'};
+const uint32_t PCM_CACHE_VERSION = 1;
+
+struct PcmCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint32_t frequency;
+    uint32_t channels;
+    uint64_t frameCount;
+};
+
+static_assert(sizeof(PcmCacheHeader) == 32, "PCM cache header must stay packed");
+
+// The song's audio as device-format float frames for the mixer. With the
+// disk cache enabled, a track is decoded once into
+// MUSIC_CACHE_DIRECTORY/<content hash>-<rate>-<channels>.pcm and played
+// straight from a mapping of that file, so loading a known track and every
+// restart cost no decoding at all. Without the cache (or if the file cannot
+// be written) the decoded chunk is kept in memory instead. load() blocks;
+// the game runs it on the asset loader.
+class MusicTrack {
+    private:
+        MappedFile pcm;
+        Mix_Chunk* chunk;
+        const float* samples;
+        uint64_t frameCount;
+        int channels;
+
+        std::string cachePath;
+        uint64_t sourceHash;
+        int frequency;
+
+        bool openCached() {
+            if (!pcm.open(cachePath)) {
+                return false;
+            }
+
+            PcmCacheHeader header;
+            if (pcm.getSize() < sizeof(header)) {
+                pcm.close();
+                return false;
+            }
+            std::memcpy(&header, pcm.getData(), sizeof(header));
+            if (std::memcmp(header.magic, PCM_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+                header.version != PCM_CACHE_VERSION || header.sourceHash != sourceHash ||
+                static_cast<int>(header.frequency) != frequency || static_cast<int>(header.channels) != channels ||
+                sizeof(header) + header.frameCount * channels * sizeof(float) > pcm.getSize()) {
+                pcm.close();
+                return false;
+            }
+
+            samples = reinterpret_cast<const float*>(pcm.getData() + sizeof(header));
+            frameCount = header.frameCount;
+            return true;
+        }
+
+        // Decodes the source and writes it to cachePath. Keeps the decoded
+        // chunk instead when the cache cannot be written.
+        bool decode(const std::string& path) {
+            Mix_Chunk* decoded = Mix_LoadWAV(path.c_str());
+            if (decoded == nullptr) {
+                std::cerr << "Failed to decode music! Mix_Error: " << Mix_GetError() << std::endl;
+                return false;
+            }
+
+            PcmCacheHeader header = {};
+            std::memcpy(header.magic, PCM_CACHE_MAGIC, sizeof(header.magic));
+            header.version = PCM_CACHE_VERSION;
+            header.sourceHash = sourceHash;
+            header.frequency = static_cast<uint32_t>(frequency);
+            header.channels = static_cast<uint32_t>(channels);
+            header.frameCount = decoded->alen / (sizeof(float) * channels);
+
+            std::error_code error;
+            std::filesystem::create_directories(std::filesystem::path(cachePath).parent_path(), error);
+            std::string partialPath = cachePath + ".part";
+            bool written = false;
+            {
+                std::ofstream out(partialPath, std::ios::binary | std::ios::trunc);
+                if (out.is_open()) {
+                    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                    out.write(reinterpret_cast<const char*>(decoded->abuf),
+                              static_cast<std::streamsize>(header.frameCount * channels * sizeof(float)));
+                    written = out.good();
+                }
+            }
+            if (written) {
+                std::filesystem::rename(partialPath, cachePath, error);
+                written = !error;
+            }
+
+            if (written) {
+                Mix_FreeChunk(decoded);
+                if (openCached()) {
+                    return true;
+                }
+                std::cerr << "Music cache unreadable: " << cachePath << "; decoding again" << std::endl;
+                decoded = Mix_LoadWAV(path.c_str());
+                if (decoded == nullptr) {
+                    std::cerr << "Failed to decode music! Mix_Error: " << Mix_GetError() << std::endl;
+                    return false;
+                }
+            } else {
+                std::cerr << "Could not write music cache " << cachePath << "; keeping it in memory" << std::endl;
+                std::filesystem::remove(partialPath, error);
+            }
+            useChunk(decoded);
+            return true;
+        }
+
+        void useChunk(Mix_Chunk* loaded) {
+            chunk = loaded;
+            samples = reinterpret_cast<const float*>(chunk->abuf);
+            frameCount = chunk->alen / (sizeof(float) * channels);
+        }
+
+    public:
+        MusicTrack() : chunk(nullptr), samples(nullptr), frameCount(0), channels(AUDIO_CHANNELS),
+                       sourceHash(0), frequency(AUDIO_FREQUENCY) {}
+
+        MusicTrack(const MusicTrack&) = delete;
+        MusicTrack& operator=(const MusicTrack&) = delete;
+
+        ~MusicTrack() {
+            unload();
+        }
+
+        // Loads `path` for a device running at `deviceFrequency` with
+        // `deviceChannels`, decoding it first if the cache has no copy.
+        bool load(const std::string& path, int deviceFrequency, int deviceChannels, bool useCache) {
+            unload();
+            frequency = deviceFrequency;
+            channels = deviceChannels;
+
+            if (!useCache) {
+                Mix_Chunk* loaded = Mix_LoadWAV(path.c_str());
+                if (loaded == nullptr) {
+                    std::cerr << "Failed to load music! Mix_Error: " << Mix_GetError() << std::endl;
+                    return false;
+                }
+                useChunk(loaded);
+                return true;
+            }
+
+            MappedFile source;
+            if (!source.open(path)) {
+                std::cerr << "Failed to open music file: " << path << std::endl;
+                return false;
+            }
+            sourceHash = fnv1a64(source.getData(), source.getSize());
+            source.close();
+
+            char name[64];
+            std::snprintf(name, sizeof(name), "%016llx-%d-%d.pcm",
+                          static_cast<unsigned long long>(sourceHash), frequency, channels);
+            cachePath = (std::filesystem::path(MUSIC_CACHE_DIRECTORY) / name).string();
+
+            return openCached() || decode(path);
+        }
+
+        // The mixer must not be playing it.
+        void unload() {
+            if (chunk != nullptr) {
+                Mix_FreeChunk(chunk);
+                chunk = nullptr;
+            }
+            pcm.close();
+            samples = nullptr;
+            frameCount = 0;
+        }
+
+        const float* getSamples() const { return samples; }
+        uint64_t getFrameCount() const { return frameCount; }
+    };
+
+// Printable ASCII rasterised once into a single texture. Strings are drawn
+// as textured quads queued into one vertex batch, which is submitted with a
+// single SDL_RenderGeometry call per frame. Rasterising only needs the font,
+// so it can run on a loader thread; the texture upload stays on the render
+// thread.
+class GlyphAtlas {
+    private:
+        static const int FIRST_GLYPH = 32;
+        static const int LAST_GLYPH = 126;
+        static const int GLYPH_COUNT = LAST_GLYPH - FIRST_GLYPH + 1;
+        static const int ATLAS_WIDTH = 512;
+
+        struct Glyph {
+            SDL_Rect source;
+            int advance;
+        };
+
+        SDL_Texture* texture;
+        SDL_Surface* staged;  // rasterised, waiting for upload()
+        Glyph glyphs[GLYPH_COUNT];
+        int atlasHeight;
+
+        std::vector<SDL_Vertex> vertices;
+        std::vector<int> indices;
+        size_t queuedGlyphs;
+
+    public:
+        GlyphAtlas() : texture(nullptr), staged(nullptr), atlasHeight(0), queuedGlyphs(0) {}
+
+        ~GlyphAtlas() {
+            destroy();
+        }
+
+        GlyphAtlas(const GlyphAtlas&) = delete;
+        GlyphAtlas& operator=(const GlyphAtlas&) = delete;
+
+        bool build(SDL_Renderer* renderer, TTF_Font* font) {
+            destroy();
+            return rasterize(font) && upload(renderer);
+        }
+
+        // Any thread, while no texture exists.
+        bool rasterize(TTF_Font* font) {
+            if (staged != nullptr) {
+                SDL_FreeSurface(staged);
+                staged = nullptr;
+            }
+
+            int lineHeight = TTF_FontHeight(font);
+            SDL_Surface* glyphSurfaces[GLYPH_COUNT] = {};
+
+            // Lay the glyphs out in rows, then blit them into one surface.
+            int x = 0;
+            int y = 0;
+            for (int i = 0; i < GLYPH_COUNT; i++) {
+                Uint16 ch = static_cast<Uint16>(FIRST_GLYPH + i);
+                int minX, maxX, minY, maxY, advance;
+                if (TTF_GlyphMetrics(font, ch, &minX, &maxX, &minY, &maxY, &advance) < 0) {
+                    advance = 0;
+                }
+
+                glyphSurfaces[i] = TTF_RenderGlyph_Blended(font, ch, {255, 255, 255, 255});
+                int width = glyphSurfaces[i] != nullptr ? glyphSurfaces[i]->w : 0;
+                if (x + width > ATLAS_WIDTH) {
+                    x = 0;
+                    y += lineHeight;
+                }
+
+                glyphs[i].source = {x, y, width, lineHeight};
+                glyphs[i].advance = advance;
+                x += width;
+            }
+            atlasHeight = y + lineHeight;
+
+            staged = SDL_CreateRGBSurfaceWithFormat(0, ATLAS_WIDTH, atlasHeight, 32, SDL_PIXELFORMAT_ARGB8888);
+            if (staged != nullptr) {
+                SDL_FillRect(staged, nullptr, SDL_MapRGBA(staged->format, 255, 255, 255, 0));
+                for (int i = 0; i < GLYPH_COUNT; i++) {
+                    if (glyphSurfaces[i] == nullptr) continue;
+                    SDL_SetSurfaceBlendMode(glyphSurfaces[i], SDL_BLENDMODE_NONE);
+                    SDL_Rect target = glyphs[i].source;
+                    SDL_BlitSurface(glyphSurfaces[i], nullptr, staged, &target);
+                }
+            }
+
+            for (SDL_Surface* surface : glyphSurfaces) {
+                SDL_FreeSurface(surface);
+            }
+
+            if (staged == nullptr) {
+                std::cerr << "Unable to rasterise glyph atlas! SDL_Error: " << SDL_GetError() << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        // Render thread: turns the rasterised glyphs into the atlas texture.
+        bool upload(SDL_Renderer* renderer) {
+            if (staged == nullptr) {
+                return false;
+            }
+            texture = SDL_CreateTextureFromSurface(renderer, staged);
+            SDL_FreeSurface(staged);
+            staged = nullptr;
+
+            if (texture == nullptr) {
+                std::cerr << "Unable to build glyph atlas! SDL_Error: " << SDL_GetError() << std::endl;
+                return false;
+            }
+            SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+
+            vertices.resize(TEXT_BATCH_GLYPHS * 4);
+            indices.resize(TEXT_BATCH_GLYPHS * 6);
+            for (int i = 0; i < TEXT_BATCH_GLYPHS; i++) {
+                int quad = i * 4;
+                int* index = &indices[i * 6];
+                index[0] = quad;
+                index[1] = quad + 1;
+                index[2] = quad + 2;
+                index[3] = quad + 2;
+                index[4] = quad + 1;
+                index[5] = quad + 3;
+            }
+            queuedGlyphs = 0;
+            return true;
+        }
+
+        void destroy() {
+            if (texture != nullptr) {
+                SDL_DestroyTexture(texture);
+                texture = nullptr;
+            }
+            if (staged != nullptr) {
+                SDL_FreeSurface(staged);
+                staged = nullptr;
+            }
+            queuedGlyphs = 0;
+        }
+
+        // Queues a string; characters outside printable ASCII draw as '?'.
+        void drawText(SDL_Renderer* renderer, FrameProfiler& profiler, const char* text, int x, int y, SDL_Color color) {
+            if (texture == nullptr) return;
+
+            float invWidth = 1.0f / ATLAS_WIDTH;
+            float invHeight = 1.0f / atlasHeight;
+            float penX = static_cast<float>(x);
+
+            for (const char* c = text; *c != '\0'; c++) {
+                int code = static_cast<unsigned char>(*c);
+                if (code < FIRST_GLYPH || code > LAST_GLYPH) {
+                    code = '?';
+                }
+                const Glyph& glyph = glyphs[code - FIRST_GLYPH];
+
+                if (glyph.source.w > 0) {
+                    if (queuedGlyphs == TEXT_BATCH_GLYPHS) {
+                        flush(renderer, profiler);
+                    }
+
+                    float left = penX;
+                    float top = static_cast<float>(y);
+                    float right = left + glyph.source.w;
+                    float bottom = top + glyph.source.h;
+                    float u0 = glyph.source.x * invWidth;
+                    float v0 = glyph.source.y * invHeight;
+                    float u1 = (glyph.source.x + glyph.source.w) * invWidth;
+                    float v1 = (glyph.source.y + glyph.source.h) * invHeight;
+
+                    SDL_Vertex* quad = &vertices[queuedGlyphs * 4];
+                    quad[0] = {{left, top}, color, {u0, v0}};
+                    quad[1] = {{right, top}, color, {u1, v0}};
+                    quad[2] = {{left, bottom}, color, {u0, v1}};
+                    quad[3] = {{right, bottom}, color, {u1, v1}};
+                    queuedGlyphs++;
+                }
+
+                penX += glyph.advance;
+            }
+        }
+
+        void flush(SDL_Renderer* renderer, FrameProfiler& profiler) {
+            if (queuedGlyphs == 0) return;
+
+            SDL_RenderGeometry(renderer, texture,
+                               vertices.data(), static_cast<int>(queuedGlyphs * 4),
+                               indices.data(), static_cast<int>(queuedGlyphs * 6));
+            profiler.addTextBatch(static_cast<int>(queuedGlyphs));
+            queuedGlyphs = 0;
+        }
+    };
+
+// Loads assets on a small worker pool. submit() returns a shared_future for
+// the job's result and may name futures from earlier jobs that it needs; a
+// job is only started once all of them are ready, so workers never block on
+// each other. Workers never touch the renderer: the main thread polls the
+// futures and does any uploads itself.
+class AssetManager {
+    private:
+        struct Job {
+            std::function<bool()> ready;
+            std::function<void()> run;
+        };
+
+        std::vector<std::thread> workers;
+        std::deque<Job> jobs;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping;
+
+        void work() {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                auto next = std::find_if(jobs.begin(), jobs.end(), [](const Job& job) { return job.ready(); });
+                if (next == jobs.end()) {
+                    if (stopping && jobs.empty()) {
+                        return;
+                    }
+                    wake.wait(lock);
+                    continue;
+                }
+
+                Job job = std::move(*next);
+                jobs.erase(next);
+                lock.unlock();
+                job.run();
+                lock.lock();
+                // Whatever was waiting on this job may be runnable now.
+                wake.notify_all();
+            }
+        }
+
+    public:
+        AssetManager() : stopping(false) {}
+
+        AssetManager(const AssetManager&) = delete;
+        AssetManager& operator=(const AssetManager&) = delete;
+
+        ~AssetManager() {
+            stop();
+        }
+
+        void start() {
+            if (!workers.empty()) {
+                return;
+            }
+            unsigned count = std::thread::hardware_concurrency();
+            count = std::max(1u, std::min(count > 1 ? count - 1 : 1u, MAX_ASSET_WORKERS));
+            for (unsigned i = 0; i < count; i++) {
+                workers.emplace_back(&AssetManager::work, this);
+            }
+        }
+
+        // Finishes every queued job, so no future is left without a value.
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+            workers.clear();
+            stopping = false;
+        }
+
+        // `deps` must come from this manager. An exception thrown by `fn`
+        // is stored in the returned future.
+        template <typename Fn, typename... Deps>
+        auto submit(Fn fn, const std::shared_future<Deps>&... deps) -> std::shared_future<decltype(fn())> {
+            using Result = decltype(fn());
+            auto task = std::make_shared<std::packaged_task<Result()>>(std::move(fn));
+            std::shared_future<Result> result = task->get_future().share();
+
+            Job job;
+            job.ready = [deps...]() { return (isReady(deps) && ...); };
+            job.run = [task]() { (*task)(); };
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs.push_back(std::move(job));
+            }
+            wake.notify_all();
+            return result;
+        }
+
+        template <typename T>
+        static bool isReady(const std::shared_future<T>& future) {
+            return future.valid() && future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+    };
+
+// Everything that changes during one play of a chart. The chart itself is
+// shared and never modified, so starting over is just reset(): no file is
+// read and, once the first play has sized the buffers, nothing is allocated.
+struct PlayState {
+    int score;
+    int combo;
+    int maxCombo;
+    int totalHits;
+    int perfectHits;
+    int greatHits;
+    int goodHits;
+    int missedHits;
+    std::vector<int16_t> hitErrors;  // signed ms per hit, capacity reserved per play
+    float hitErrorMean;
+    float unstableRate;
+    Judgment currentJudgment;
+
+    NoteQueue columnNotes[COLUMN_COUNT];
+    NoteScheduler noteScheduler;
+    float gameTime;          // time of the latest simulation tick
+    float previousGameTime;  // time of the tick before it, for interpolation
+    int64_t simulationTicks;
+    double simulationAccumulator;  // real time not yet simulated, in seconds
+    float noteGenerationTimer;
+    float nextGenerationInterval;
+
+    PlayState() : nextGenerationInterval(0.5f) {
+        reset(nullptr);
+    }
+
+    // `chart` may be null when notes are generated rather than charted.
+    void reset(const Beatmap* chart) {
+        score = 0;
+        combo = 0;
+        maxCombo = 0;
+        totalHits = 0;
+        perfectHits = 0;
+        greatHits = 0;
+        goodHits = 0;
+        missedHits = 0;
+        hitErrors.clear();
+        hitErrors.reserve(std::max(chart != nullptr ? chart->getNoteCount() : 0, MIN_HIT_ERROR_CAPACITY));
+        hitErrorMean = 0.0f;
+        unstableRate = 0.0f;
+        currentJudgment.type = JudgmentType::NONE;
+        currentJudgment.displayTime = 0.0f;
+        currentJudgment.text = "";
+
+        for (NoteQueue& queue : columnNotes) {
+            queue.clear();
+        }
+        if (chart != nullptr) {
+            noteScheduler.reset(*chart);
+        }
+        gameTime = 0.0f;
+        previousGameTime = 0.0f;
+        simulationTicks = 0;
+        simulationAccumulator = 0.0;
+        noteGenerationTimer = 0.0f;
+    }
+
+    float getAccuracy() const {
+        if (totalHits == 0) return 100.0f;
+        return (perfectHits * 300.0f + greatHits * 200.0f + goodHits * 100.0f) / (totalHits * 300.0f) * 100.0f;
+    }
+};
+
+// What a column press did: NONE if no note was in range, otherwise the
+// judgment and the hit time of the note it took.
+struct PressResult {
+    JudgmentType type;
+    float noteTime;
+};
+
+// Column presses known up front, in time order, for driving a
+// GameplayEngine without a frontend. Reads like the input queue.
+class PressSequence {
+    private:
+        std::vector<ColumnPress> presses;
+        size_t next;
+
+    public:
+        PressSequence() : next(0) {}
+
+        void clear() {
+            presses.clear();
+            next = 0;
+        }
+
+        void push(int column, double time) { presses.push_back({column, time}); }
+        void rewind() { next = 0; }
+
+        bool peek(ColumnPress& press) const {
+            if (next == presses.size()) return false;
+            press = presses[next];
+            return true;
+        }
+
+        bool pop(ColumnPress& press) {
+            if (!peek(press)) return false;
+            next++;
+            return true;
+        }
+
+        size_t size() const { return presses.size(); }
+    };
+
+// The game rules with no window, renderer or audio device: spawning notes
+// from the chart (or generating them when there is none), advancing in
+// fixed SIMULATION_STEP ticks, and judging and scoring timestamped column
+// presses. OsuMania drives it from the song clock and draws its state;
+// anything else can feed it presses and run it as fast as the CPU allows.
+class GameplayEngine {
+    private:
+        std::shared_ptr<const Beatmap> chart;  // null when notes are generated
+        PlayState play;
+        JudgmentWindows judgmentWindows;
+        float spawnLeadTime;
+        std::mt19937 rng;
+        bool skipIdleTicks;
+
+        // First tick at which a note could spawn or expire, or the press at
+        // `nextPressTime` be judged, capped at `lastTick`. Errs a tick early,
+        // which is far more than float rounding can be off by.
+        int64_t nextBusyTick(double nextPressTime, int64_t lastTick) const {
+            double earliest = nextPressTime;
+            if (play.noteScheduler.hasMoreNotes()) {
+                earliest = std::min(earliest, static_cast<double>(play.noteScheduler.getNextTime()) -
+                                              getQueueLeadTime() + chart->getOffset());
+            }
+            for (const NoteQueue& queue : play.columnNotes) {
+                if (!queue.empty()) {
+                    earliest = std::min(earliest, static_cast<double>(queue.front()) +
+                                                  judgmentWindows.missMs / 1000.0 + chart->getOffset());
+                }
+            }
+            earliest = std::min(earliest * SIMULATION_RATE, static_cast<double>(lastTick));
+            return static_cast<int64_t>(std::floor(earliest)) - 1;
+        }
+
+        // Moves the clock to the end of tick `target` without running the
+        // ticks in between, which nextBusyTick() has shown to be idle.
+        void skipTo(int64_t target) {
+            float skipped = static_cast<float>(target - play.simulationTicks) * SIMULATION_STEP;
+            play.simulationTicks = target;
+            play.previousGameTime = static_cast<float>((target - 1) / static_cast<double>(SIMULATION_RATE));
+            play.gameTime = static_cast<float>(target / static_cast<double>(SIMULATION_RATE));
+            if (play.currentJudgment.type != JudgmentType::NONE) {
+                play.currentJudgment.displayTime -= skipped;
+                if (play.currentJudgment.displayTime <= 0.0f) {
+                    play.currentJudgment.type = JudgmentType::NONE;
+                }
+            }
+        }
+
+        void generateNotePattern(int notesCount) {
+            // Random notes enter at the top of the screen as soon as they are generated.
+            float spawnTime = getSongTime() + spawnLeadTime;
+
+            switch(notesCount) {
+                case 1:
+                    {
+                        std::uniform_int_distribution<int> columnDist(0, COLUMN_COUNT - 1);
+                        int columnIndex = columnDist(rng);
+                        createNote(columnIndex, spawnTime);
+                    }
+                    break;
+                
+                case 2:
+                    {
+                        std::uniform_int_distribution<int> patternDist(0, 1);
+                        int patternType = patternDist(rng);
+                        
+                        if (patternType == 0) {
+                            std::uniform_int_distribution<int> startColDist(0, COLUMN_COUNT - 2);
+                            int startCol = startColDist(rng);
+                            createNote(startCol, spawnTime);
+                            createNote(startCol + 1, spawnTime);
+                        } else {
+                            createNote(0, spawnTime);
+                            createNote(COLUMN_COUNT - 1, spawnTime);
+                        }
+                    }
+                    break;
+                
+                case 3:
+                    {
+                        std::array<int, COLUMN_COUNT> availableCols;
+                        for (int i = 0; i < COLUMN_COUNT; i++) {
+                            availableCols[i] = i;
+                        }
+                        
+                        std::shuffle(availableCols.begin(), availableCols.end(), rng);
+                        
+                        for (int i = 0; i < 3 && i < COLUMN_COUNT; i++) {
+                            createNote(availableCols[i], spawnTime);
+                        }
+                    }
+                    break;
+                    
+                default:
+                    {
+                        std::uniform_int_distribution<int> columnDist(0, COLUMN_COUNT - 1);
+                        int columnIndex = columnDist(rng);
+                        createNote(columnIndex, spawnTime);
+                    }
+                    break;
+            }
+        }
+        
+        void createNote(int columnIndex, float hitTime) {
+            play.columnNotes[columnIndex].push(hitTime);
+        }
+
+        bool hasLiveNotes() const {
+            for (int i = 0; i < COLUMN_COUNT; i++) {
+                if (!play.columnNotes[i].empty()) return true;
+            }
+            return false;
+        }
+
+        // Signed timing error of a hit in ms; negative is early.
+        void recordHitError(int errorMs) {
+            if (play.hitErrors.size() < play.hitErrors.capacity()) {
+                play.hitErrors.push_back(static_cast<int16_t>(errorMs));
+            }
+        }
+        
+        void handleMiss() {
+            showJudgment(JudgmentType::MISS);
+            play.combo = 0;
+            play.totalHits++;
+            play.missedHits++;
+        }
+        
+        void showJudgment(JudgmentType type) {
+            play.currentJudgment.type = type;
+            play.currentJudgment.displayTime = 0.5f;
+            
+            switch (type) {
+                case JudgmentType::PERFECT:
+                    play.currentJudgment.text = "PERFECT";
+                    play.currentJudgment.color = {255, 230, 0, 255}; // gold
+                    break;
+                case JudgmentType::GREAT:
+                    play.currentJudgment.text = "GREAT";
+                    play.currentJudgment.color = {0, 255, 0, 255}; // green
+                    break;
+                case JudgmentType::GOOD:
+                    play.currentJudgment.text = "GOOD";
+                    play.currentJudgment.color = {0, 200, 255, 255}; // blue
+                    break;
+                case JudgmentType::MISS:
+                    play.currentJudgment.text = "MISS";
+                    play.currentJudgment.color = {255, 0, 0, 255}; // red
+                    break;
+                default:
+                    break;
+            }
+        }
+
+    public:
+        GameplayEngine() :
+            judgmentWindows(JudgmentWindows::standard()),
+            spawnLeadTime((JUDGMENT_LINE_Y + NOTE_HEIGHT) / static_cast<float>(NOTE_SPEED)),
+            rng(std::mt19937::default_seed),
+            skipIdleTicks(false) {}
+
+        // Takes effect at the next reset().
+        void setChart(std::shared_ptr<const Beatmap> newChart) { chart = std::move(newChart); }
+        void setJudgmentWindows(const JudgmentWindows& windows) { judgmentWindows = windows; }
+        const JudgmentWindows& getJudgmentWindows() const { return judgmentWindows; }
+        // How long before its hit time a note appears. Charted notes are
+        // queued at least a miss window ahead regardless, so this only
+        // decides when they are drawn, never how they are judged.
+        void setSpawnLeadTime(float seconds) { spawnLeadTime = seconds; }
+
+        // How far ahead of its hit time a charted note is queued: in time to
+        // enter at the top of the screen, and before any press that could
+        // take it (one tick plus a millisecond of rounding past missMs).
+        float getQueueLeadTime() const {
+            return std::max(spawnLeadTime, (judgmentWindows.missMs + 1) / 1000.0f + SIMULATION_STEP);
+        }
+        // Only generated notes are random.
+        void seed(uint32_t value) { rng.seed(value); }
+        // For headless runs of a chart: advance() jumps over ticks in which
+        // nothing can happen. Judgments are unchanged; the judgment display
+        // times out in one step rather than tick by tick.
+        void setSkipIdleTicks(bool skip) { skipIdleTicks = skip; }
+
+        void reset() {
+            play.reset(chart.get());
+            std::uniform_real_distribution<float> timeDist(MIN_SPAWN_INTERVAL, MAX_SPAWN_INTERVAL);
+            play.nextGenerationInterval = timeDist(rng);
+        }
+
+        // Runs ticks up to game time `targetTime`, at most `maxTicks` of
+        // them. Presses are popped from `inputs` (anything with peek() and
+        // pop() of ColumnPress) and judged just before the tick they fall
+        // in, each at its own timestamp; `onPress(press, result, songTime)`
+        // sees every one. What is left over is kept for interpolation, and
+        // a backlog beyond `maxTicks` is worked off by later calls.
+        template <typename Inputs, typename OnPress>
+        int advance(double targetTime, int maxTicks, Inputs& inputs, OnPress onPress) {
+            int ticks = 0;
+            while (ticks < maxTicks && (play.simulationTicks + 1) <= targetTime * SIMULATION_RATE) {
+                ColumnPress press;
+                if (skipIdleTicks && chart != nullptr) {
+                    double nextPressTime = inputs.peek(press) ? press.time : std::numeric_limits<double>::infinity();
+                    int64_t lastTick = std::min(static_cast<int64_t>(targetTime * SIMULATION_RATE),
+                                                play.simulationTicks + (maxTicks - ticks));
+                    int64_t busyTick = nextBusyTick(nextPressTime, lastTick);
+                    if (busyTick - 1 > play.simulationTicks) {
+                        ticks += static_cast<int>(busyTick - 1 - play.simulationTicks);
+                        skipTo(busyTick - 1);
+                        continue;
+                    }
+                }
+
+                double tickEnd = static_cast<double>(play.simulationTicks + 1) / SIMULATION_RATE;
+                while (inputs.peek(press) && press.time <= tickEnd) {
+                    inputs.pop(press);
+                    float songTime = toSongTime(static_cast<float>(press.time));
+                    onPress(press, this->press(press.column, songTime), songTime);
+                }
+
+                tick();
+                ticks++;
+            }
+
+            play.simulationAccumulator = std::max(0.0, targetTime - play.simulationTicks / static_cast<double>(SIMULATION_RATE));
+            return ticks;
+        }
+
+        // One SIMULATION_STEP: spawns notes, expires missed ones and ages
+        // the judgment display.
+        void tick() {
+            const float deltaTime = SIMULATION_STEP;
+            play.previousGameTime = play.gameTime;
+            play.simulationTicks++;
+            play.gameTime = static_cast<float>(play.simulationTicks / static_cast<double>(SIMULATION_RATE));
+            
+            float songTime = getSongTime();
+
+            if (chart != nullptr) {
+                // Spawn ahead of time so each note reaches the judgment line on its beat.
+                play.noteScheduler.advance(songTime + getQueueLeadTime(), [this](float time, int column) {
+                    createNote(column, time);
+                });
+            } else {
+                play.noteGenerationTimer += deltaTime;
+                if (play.noteGenerationTimer > play.nextGenerationInterval) {
+
+                    std::uniform_int_distribution<int> notesCountDist(MIN_NOTES_PER_SPAWN, MAX_NOTES_PER_SPAWN);
+                    int notesToGenerate = notesCountDist(rng);
+                    
+                    generateNotePattern(notesToGenerate);
+                    
+                    play.noteGenerationTimer = 0.0f;
+                    std::uniform_real_distribution<float> timeDist(MIN_SPAWN_INTERVAL, MAX_SPAWN_INTERVAL);
+                    play.nextGenerationInterval = timeDist(rng);
+                }
+            }
+            
+            // Columns are time-ordered, so only the oldest notes can have been
+            // missed: those more than the miss window past their hit time.
+            float missCutoff = songTime - judgmentWindows.missMs / 1000.0f;
+            for (int i = 0; i < COLUMN_COUNT; i++) {
+                NoteQueue& queue = play.columnNotes[i];
+                for (size_t missed = queue.countBefore(missCutoff); missed > 0; missed--) {
+                    queue.popFront();
+                    handleMiss();
+                }
+            }
+            
+            if (play.currentJudgment.type != JudgmentType::NONE) {
+                play.currentJudgment.displayTime -= deltaTime;
+                if (play.currentJudgment.displayTime <= 0.0f) {
+                    play.currentJudgment.type = JudgmentType::NONE;
+                }
+            }
+        }
+        
+        // Judges a press in columnIndex made at songTime, which may fall between
+        // simulation ticks.
+        PressResult press(int columnIndex, float songTime) {
+            NoteQueue& queue = play.columnNotes[columnIndex];
+
+            // Timing error falls and then rises along a time-ordered column, so
+            // the closest note is found within the first few.
+            size_t closestIndex = 0;
+            int closestError = 0;
+            int closestDistance = std::numeric_limits<int>::max();
+            for (size_t i = 0; i < queue.size(); i++) {
+                int errorMs = static_cast<int>(std::lround((songTime - queue.at(i)) * 1000.0f));
+                int distance = std::abs(errorMs);
+                if (distance >= closestDistance) break;
+                closestDistance = distance;
+                closestError = errorMs;
+                closestIndex = i;
+            }
+            
+            if (queue.empty() || closestDistance >= judgmentWindows.missMs) {
+                return {JudgmentType::NONE, 0.0f};
+            }
+
+            PressResult result = {JudgmentType::MISS, queue.at(closestIndex)};
+            queue.removeAt(closestIndex);
+
+            if (closestDistance >= judgmentWindows.goodMs) {
+                handleMiss();
+                return result;
+            }
+
+            play.totalHits++;
+            recordHitError(closestError);
+            
+            if (closestDistance < judgmentWindows.perfectMs) {
+                result.type = JudgmentType::PERFECT;
+                play.score += 300 + play.combo * 5;
+                play.combo++;
+                play.perfectHits++;
+            } else if (closestDistance < judgmentWindows.greatMs) {
+                result.type = JudgmentType::GREAT;
+                play.score += 200 + play.combo * 3;
+                play.combo++;
+                play.greatHits++;
+            } else {
+                result.type = JudgmentType::GOOD;
+                play.score += 100 + play.combo;
+                play.combo++;
+                play.goodHits++;
+            }
+            showJudgment(result.type);
+            
+            if (play.combo > play.maxCombo) {
+                play.maxCombo = play.combo;
+            }
+            return result;
+        }
+
+        // Every charted note has been judged and the chart's length has
+        // passed. Generated notes never finish.
+        bool isFinished() const {
+            return chart != nullptr && !play.noteScheduler.hasMoreNotes() && !hasLiveNotes() &&
+                   play.gameTime > (chart->getSongLength() + chart->getOffset());
+        }
+
+        // Fills in the mean signed error and unstable rate (10x the standard
+        // deviation, as in osu!) from the hits so far.
+        void computeHitErrorStats() {
+            play.hitErrorMean = 0.0f;
+            play.unstableRate = 0.0f;
+            if (play.hitErrors.empty()) return;
+
+            double sum = 0.0;
+            for (int16_t error : play.hitErrors) {
+                sum += error;
+            }
+            double mean = sum / play.hitErrors.size();
+
+            double variance = 0.0;
+            for (int16_t error : play.hitErrors) {
+                variance += (error - mean) * (error - mean);
+            }
+            variance /= play.hitErrors.size();
+
+            play.hitErrorMean = static_cast<float>(mean);
+            play.unstableRate = static_cast<float>(10.0 * std::sqrt(variance));
+        }
+
+        void clearNotes() {
+            for (int i = 0; i < COLUMN_COUNT; i++) {
+                play.columnNotes[i].clear();
+            }
+        }
+
+        float getSongTime() const {
+            return toSongTime(play.gameTime);
+        }
+
+        // Song time between the last two ticks, matching how much real time
+        // has passed since the latest one.
+        float getInterpolatedSongTime() const {
+            float alpha = std::min(1.0f, static_cast<float>(play.simulationAccumulator / SIMULATION_STEP));
+            return toSongTime(play.previousGameTime + (play.gameTime - play.previousGameTime) * alpha);
+        }
+
+        float toSongTime(float time) const {
+            return chart == nullptr ? time : time - chart->getOffset();
+        }
+
+        const PlayState& getState() const { return play; }
+    };
+
+// Replay files, in REPLAY_DIRECTORY:
+//   ReplayHeader
+//   one varint per key event: (microseconds since the previous event << 4)
+//                             | (column << 1) | (1 if the key went down)
+// Times are game time, so the first event counts from the start of the
+// play. The event stream simply runs to the end of the file.
+const char REPLAY_MAGIC[4] = {'O', 'M', 'R', 'P'};
+const uint32_t REPLAY_VERSION = 1;
+const char* const REPLAY_EXTENSION = ".omr";
+
+struct ReplayHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t chartHash;  // replayChartHash(), 0 for generated notes
+    uint32_t seed;       // note generator seed, for generated notes
+    uint32_t columns;
+    int32_t perfectMs;
+    int32_t greatMs;
+    int32_t goodMs;
+    int32_t missMs;
+    float scrollSpeed;   // at the start of the play; it only affects drawing
+    uint32_t reserved;
+};
+
+static_assert(sizeof(ReplayHeader) == 48, "replay header must stay packed");
+static_assert(COLUMN_COUNT <= 8, "replay events hold the column in 3 bits");
+
+// Identifies a chart by what is judged: note times, columns and offset.
+uint64_t replayChartHash(const Beatmap& chart) {
+    uint64_t hash = fnv1a64(reinterpret_cast<const unsigned char*>(chart.getNoteTimes()),
+                            chart.getNoteCount() * sizeof(float));
+    hash = fnv1a64(chart.getNoteColumns(), chart.getNoteCount(), hash);
+    float offset = chart.getOffset();
+    return fnv1a64(reinterpret_cast<const unsigned char*>(&offset), sizeof(offset), hash);
+}
+
+// LEB128: seven bits per byte, low bits first. Writes at most 10 bytes.
+size_t encodeVarint(uint64_t value, uint8_t* out) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = static_cast<uint8_t>(value);
+    return length;
+}
+
+// Records a play's key events to replay files. begin(), record() and end()
+// only push onto preallocated queues, so they are safe on the gameplay path
+// and starting a play does no file I/O. A writer thread, started once,
+// creates, fills and closes the files: it encodes the ring every
+// REPLAY_FLUSH_INTERVAL_MS through a fixed buffer. Markers in the ring
+// split it into plays, so a retry can begin the next file before the
+// writer has finished the last one.
+class ReplayRecorder {
+    private:
+        enum EventKind : uint8_t { KEY_UP, KEY_DOWN, BEGIN, END };
+
+        struct Event {
+            double time;
+            int column;  // for END, the key events dropped since BEGIN
+            EventKind kind;
+        };
+
+        SpscQueue<Event, REPLAY_RING_CAPACITY> ring;
+        struct Pending {
+            ReplayHeader header;
+            std::chrono::system_clock::time_point started;
+        };
+
+        SpscQueue<Pending, REPLAY_PENDING_CAPACITY> pending;  // one per BEGIN
+        std::thread writer;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping;
+        bool recording;  // main thread: a BEGIN has been queued without its END
+        int droppedEvents;
+
+        // Writer thread, or stop() once it has joined.
+        std::ofstream out;
+        std::string path;
+        int64_t lastMicros;
+        uint8_t chunk[REPLAY_WRITE_CHUNK];
+        size_t chunkUsed;
+        uint64_t eventCount;
+        uint64_t byteCount;
+
+        void writeChunk() {
+            if (chunkUsed == 0) return;
+            out.write(reinterpret_cast<const char*>(chunk), static_cast<std::streamsize>(chunkUsed));
+            byteCount += chunkUsed;
+            chunkUsed = 0;
+        }
+
+        // Opens a new file named after the time the play began.
+        void open(const Pending& replay) {
+            std::error_code error;
+            std::filesystem::create_directories(REPLAY_DIRECTORY, error);
+
+            std::time_t seconds = std::chrono::system_clock::to_time_t(replay.started);
+            int millis = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                replay.started.time_since_epoch()).count() % 1000);
+            char stamp[32];
+            std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", std::localtime(&seconds));
+            char name[64];
+            std::snprintf(name, sizeof(name), "%s-%03d%s", stamp, millis, REPLAY_EXTENSION);
+            path = (std::filesystem::path(REPLAY_DIRECTORY) / name).string();
+
+            out.open(path + ".part", std::ios::binary | std::ios::trunc);
+            if (!out.is_open()) {
+                std::cerr << "Failed to create replay file: " << path << std::endl;
+                return;
+            }
+            out.write(reinterpret_cast<const char*>(&replay.header), sizeof(replay.header));
+
+            lastMicros = 0;
+            chunkUsed = 0;
+            eventCount = 0;
+            byteCount = sizeof(replay.header);
+        }
+
+        // Writes out the open file's last events, closes it and renames it
+        // into place.
+        void finish(int dropped) {
+            if (!out.is_open()) return;
+            writeChunk();
+
+            bool written = out.good();
+            out.close();
+            std::error_code error;
+            if (written) {
+                std::filesystem::rename(path + ".part", path, error);
+            }
+            if (!written || error) {
+                std::cerr << "Failed to write replay file: " << path << std::endl;
+                return;
+            }
+
+            std::cout << "Replay saved: " << path << " (" << eventCount << " key events, "
+                      << byteCount << " bytes)" << std::endl;
+            if (dropped > 0) {
+                std::cerr << "Replay is missing " << dropped << " key events" << std::endl;
+            }
+        }
+
+        void drain() {
+            Event event;
+            while (ring.pop(event)) {
+                if (event.kind == BEGIN) {
+                    finish(0);
+                    Pending replay;
+                    if (pending.pop(replay)) {
+                        open(replay);
+                    }
+                    continue;
+                }
+                if (event.kind == END) {
+                    finish(event.column);
+                    continue;
+                }
+                if (!out.is_open()) continue;
+
+                // The song clock can step back slightly while it slews.
+                int64_t micros = std::max(lastMicros, static_cast<int64_t>(std::llround(event.time * 1e6)));
+                uint64_t value = (static_cast<uint64_t>(micros - lastMicros) << 4) |
+                                 (static_cast<uint64_t>(event.column) << 1) | (event.kind == KEY_DOWN ? 1 : 0);
+                lastMicros = micros;
+
+                if (chunkUsed + 10 > sizeof(chunk)) {
+                    writeChunk();
+                }
+                chunkUsed += encodeVarint(value, chunk + chunkUsed);
+                eventCount++;
+            }
+            if (out.is_open()) {
+                writeChunk();
+                out.flush();
+            }
+        }
+
+        void run() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping) {
+                wake.wait_for(lock, std::chrono::milliseconds(REPLAY_FLUSH_INTERVAL_MS));
+                lock.unlock();
+                drain();
+                lock.lock();
+            }
+        }
+
+    public:
+        ReplayRecorder() : stopping(false), recording(false), droppedEvents(0), lastMicros(0), chunkUsed(0),
+                           eventCount(0), byteCount(0) {}
+
+        ReplayRecorder(const ReplayRecorder&) = delete;
+        ReplayRecorder& operator=(const ReplayRecorder&) = delete;
+
+        ~ReplayRecorder() {
+            stop();
+        }
+
+        // Starts the writer thread. Call once, before the first begin().
+        void start() {
+            if (writer.joinable()) return;
+            stopping = false;
+            writer = std::thread(&ReplayRecorder::run, this);
+        }
+
+        // Ends any replay being recorded, writes out everything queued and
+        // joins the writer.
+        void stop() {
+            if (!writer.joinable()) return;
+            end();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            writer.join();
+            drain();
+            finish(0);
+        }
+
+        // Main thread. Starts a new replay file named after the current
+        // time, ending any replay still being recorded; the writer creates
+        // the file.
+        bool begin(const ReplayHeader& header) {
+            end();
+            // The BEGIN push cannot fail once the ring has room: only the
+            // writer takes from it. So a header is never queued without it.
+            if (!writer.joinable() || ring.full() || !pending.push({header, std::chrono::system_clock::now()})) {
+                std::cerr << "Replay not recorded: the writer is behind" << std::endl;
+                return false;
+            }
+            ring.push({0.0, 0, BEGIN});
+            recording = true;
+            droppedEvents = 0;
+            return true;
+        }
+
+        // Main thread. `time` is the game time of the key event.
+        void record(int column, double time, bool down) {
+            if (!recording) return;
+            if (!ring.push({time, column, down ? KEY_DOWN : KEY_UP})) {
+                droppedEvents++;
+            }
+        }
+
+        // Main thread. The writer closes the file at its next flush.
+        void end() {
+            if (!recording) return;
+            recording = false;
+            if (!ring.push({0.0, droppedEvents, END})) {
+                // The next BEGIN, or stop(), closes the file instead.
+                droppedEvents = 0;
+            }
+        }
+
+        bool isRecording() const { return recording; }
+    };
+
+// Reads one LEB128 varint, advancing `cursor`. False if it runs past `end`.
+bool decodeVarint(const uint8_t*& cursor, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && cursor < end; shift += 7) {
+        uint8_t byte = *cursor++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads a replay's header and its key-down events into `presses`, whose
+// storage is reused. Key-ups are skipped: nothing is judged on release.
+// Fails quietly, since the verifier reports bad files itself.
+bool loadReplay(const std::string& path, ReplayHeader& header, PressSequence& presses) {
+    presses.clear();
+
+    MappedFile file;
+    if (!file.open(path) || file.getSize() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, file.getData(), sizeof(header));
+    if (std::memcmp(header.magic, REPLAY_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != REPLAY_VERSION || header.columns == 0 || header.columns > 8 ||
+        !(header.scrollSpeed >= MIN_NOTE_SPEED && header.scrollSpeed <= MAX_NOTE_SPEED)) {
+        return false;
+    }
+    // Windows the game could not have played with would let a replay judge
+    // itself leniently.
+    JudgmentWindows windows = {header.perfectMs, header.greatMs, header.goodMs, header.missMs};
+    if (!windows.isValid()) {
+        return false;
+    }
+
+    const uint8_t* cursor = file.getData() + sizeof(header);
+    const uint8_t* end = file.getData() + file.getSize();
+    uint64_t micros = 0;
+    while (cursor < end) {
+        uint64_t value;
+        if (!decodeVarint(cursor, end, value)) {
+            return false;
+        }
+        micros += value >> 4;
+        int column = static_cast<int>((value >> 1) & 7);
+        if (column >= static_cast<int>(header.columns)) {
+            return false;
+        }
+        if (value & 1) {
+            presses.push(column, micros / 1e6);
+        }
+    }
+    return true;
+}
+
+// Writes `value` as a JSON string literal.
+void writeJsonString(std::ostream& out, const std::string& value) {
+    out << '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+// Builds a synthetic text beatmap with the given number of note lines,
+// `interval` seconds apart in random columns. It names no music.
+std::string generateSyntheticBeatmapText(size_t noteLines, double interval = 0.05) {
+    std::string text = "Synthetic Chart\n\n0\n";
+    text.reserve(text.size() + noteLines * 12);
+
+    std::mt19937 rng(12345);
+    std::uniform_int_distribution<int> columnDist(0, COLUMN_COUNT - 1);
+    char line[32];
+    for (size_t i = 0; i < noteLines; i++) {
+        int length = std::snprintf(line, sizeof(line), "%.3f,%d\n", i * interval, columnDist(rng));
+        text.append(line, length);
+    }
+    return text;
+}
+
+class OsuMania {
+private:
+    SDL_Window* window;
+    SDL_Renderer* renderer;
+    TTF_Font* font;
+    GlyphAtlas glyphAtlas;
+    FrameProfiler profiler;
+    FrameLimiter frameLimiter;
+    FramePacing framePacing;
+    int targetFps;
+
+    AssetManager assets;
+    std::shared_future<TTF_Font*> fontLoad;
+    std::shared_future<bool> atlasLoad;
+    std::shared_future<std::shared_ptr<const Beatmap>> chartLoad;
+    std::shared_future<bool> musicLoad;  // the job writes `music`; leave it alone until this is ready
+    bool atlasPending;
+    bool chartPending;
+    bool musicPending;
+
+    MusicTrack music;
+    bool useMusicCache;
+    uint64_t musicEndFrame;
+    bool musicPlaying;
     
-    int score;
-    int combo;
-    int maxCombo;
-    int totalHits;
-    int perfectHits;
-    int greatHits;
-    int goodHits;
-    int missedHits;
+    std::vector<float> noteYs;  // scratch for render, sized to the largest column
+    std::vector<SDL_Vertex> noteVertices;
+    std::vector<int> noteIndices;
+    SDL_Texture* playfieldLayers[2];  // every key idle, every key pressed
+    bool keyStates[COLUMN_COUNT];
+    bool gameRunning;
+    bool gameStarted;
+    bool gameEnded;
     
     float columnWidth;
-    Judgment currentJudgment;
-    
-    std::mt19937 rng;
+    float scrollSpeed;  // pixels per second
 
-    std::chrono::time_point<std::chrono::high_resolution_clock> lastFrameTime;
-    std::chrono::time_point<std::chrono::high_resolution_clock> gameStartTime;
-    float noteGenerationTimer;
-    float nextGenerationInterval;
+    std::shared_ptr<const Beatmap> chart;  // immutable once loaded, shared by every play
+    GameplayEngine engine;
+    std::mt19937 seedSource;
+    uint32_t playSeed;  // generated notes are reproducible from this, so it goes in the replay
+    ReplayRecorder replay;
+
+    SongClock songClock;
+    SoftwareMixer mixer;
+    HitsoundPool hitsounds;
+    KeysoundCache keysounds;
+    VoiceAllocator keysoundVoices;
+    int audioBufferFrames;
+    uint32_t underrunsAtLastCheck;
+    SpscQueue<TimedEvent, INPUT_QUEUE_CAPACITY> inputQueue;
+    SpscQueue<ColumnPress, INPUT_QUEUE_CAPACITY> columnPresses;
+    uint64_t droppedInputEvents;
     
-    Beatmap currentBeatmap;
-    float gameTime;
     bool useRandomNotes;
     std::string beatmapFile;
+
+    FrameArena frameArena;
+    bool strictAllocations;
+    int playFrames;
+    uint64_t steadyStateAllocations;
+
+    bool autoplay;
+    size_t autoplayNote;                   // next chart note to press
+    double autoplayRelease[COLUMN_COUNT];  // game time each held key is let go, infinity if up
+
+    double benchmarkSeconds;  // 0 outside --benchmark
+    std::string benchmarkOutput;
+    size_t stressNotes;       // when non-zero, a generated chart replaces beatmapFile
+    bool benchmarkRunning;
+    Uint64 benchmarkStart;
+    uint64_t benchmarkAllocations;  // heap allocation count when the run started
+    int benchmarkPlays;
     
     public:
     OsuMania() : 
         window(nullptr), 
         renderer(nullptr), 
         font(nullptr),
-        music(nullptr),
+        framePacing(FramePacing::CAPPED),
+        targetFps(DEFAULT_TARGET_FPS),
+        atlasPending(false),
+        chartPending(false),
+        musicPending(false),
+        useMusicCache(true),
+        musicEndFrame(0),
         musicPlaying(false),
-        musicStartTime(0.0f),
-        musicLoaded(false),
         gameRunning(true),
         gameStarted(false),
         gameEnded(false),
-        score(0),
-        combo(0),
-        maxCombo(0),
-        totalHits(0),
-        perfectHits(0),
-        greatHits(0),
-        goodHits(0),
-        missedHits(0),
         columnWidth(SCREEN_WIDTH / COLUMN_COUNT),
-        noteGenerationTimer(0.0f),
-        nextGenerationInterval(0.5f),
-        gameTime(0.0f),
+        scrollSpeed(NOTE_SPEED),
+        chart(std::make_shared<Beatmap>()),
+        playSeed(0),
+        keysoundVoices(FIRST_KEYSOUND_VOICE),
+        audioBufferFrames(DEFAULT_AUDIO_BUFFER_FRAMES),
+        underrunsAtLastCheck(0),
+        droppedInputEvents(0),
         useRandomNotes(true),
-        beatmapFile("his_theme.txt")
+        beatmapFile("his_theme.txt"),
+        frameArena(FRAME_ARENA_SIZE),
+        strictAllocations(false),
+        playFrames(0),
+        steadyStateAllocations(0),
+        autoplay(false),
+        autoplayNote(0),
+        benchmarkSeconds(0.0),
+        stressNotes(0),
+        benchmarkRunning(false),
+        benchmarkStart(0),
+        benchmarkAllocations(0),
+        benchmarkPlays(0)
     {
         for (int i = 0; i < COLUMN_COUNT; i++) {
             keyStates[i] = false;
+            autoplayRelease[i] = std::numeric_limits<double>::infinity();
         }
-        
-        currentJudgment.type = JudgmentType::NONE;
-        currentJudgment.displayTime = 0.0f;
+        playfieldLayers[0] = nullptr;
+        playfieldLayers[1] = nullptr;
         
         std::random_device rd;
-        rng = std::mt19937(rd());
+        seedSource.seed(rd());
     }
     
     ~OsuMania() {
@@ -259,6 +3739,13 @@ private:
         if (!mapFile.empty()) {
             beatmapFile = mapFile;
         }
+
+        if (benchmarkSeconds > 0.0) {
+            // No real window or sound card, so runs compare across machines.
+            // SDL_VIDEODRIVER and SDL_AUDIODRIVER still take precedence.
+            SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+            SDL_SetHint(SDL_HINT_AUDIODRIVER, "dummy");
+        }
         
         if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
             std::cerr << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
@@ -269,11 +3756,17 @@ private:
             std::cerr << "SDL_ttf could not initialize! TTF_Error: " << TTF_GetError() << std::endl;
             return false;
         }
-        
-        if (Mix_OpenAudio(AUDIO_FREQUENCY, MIX_DEFAULT_FORMAT, AUDIO_CHANNELS, AUDIO_CHUNKSIZE) < 0) {
-            std::cerr << "SDL_mixer could not initialize! Mix_Error: " << Mix_GetError() << std::endl;
+
+        // Fonts, the chart and the music load while the device and window
+        // are opened; the first frame is drawn whether or not they are done.
+        assets.start();
+        requestFont();
+        replay.start();
+
+        if (!openAudio(audioBufferFrames)) {
             return false;
         }
+        requestChart();
         
         window = SDL_CreateWindow("osu!mania Clone", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 
                                  SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
@@ -282,69 +3775,239 @@ private:
             return false;
         }
         
-        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+        Uint32 rendererFlags = benchmarkSeconds > 0.0 ? SDL_RENDERER_SOFTWARE : SDL_RENDERER_ACCELERATED;
+        if (framePacing == FramePacing::VSYNC) {
+            rendererFlags |= SDL_RENDERER_PRESENTVSYNC;
+        }
+        renderer = SDL_CreateRenderer(window, -1, rendererFlags);
         if (renderer == nullptr) {
             std::cerr << "Renderer could not be created! SDL_Error: " << SDL_GetError() << std::endl;
             return false;
         }
         
-        font = TTF_OpenFont("fonts/arial.ttf", 24);
-        if (font == nullptr) {
-            std::cerr << "Failed to load font! TTF_Error: " << TTF_GetError() << std::endl;
+        buildPlayfieldLayers();
+        
+        frameLimiter.setTargetFps(framePacing == FramePacing::CAPPED ? targetFps : 0);
+        
+        return true;
+    }
 
-            font = TTF_OpenFont("fonts/FreeSans.ttf", 24);
-            if (font == nullptr) {
-                std::cerr << "Failed to load fallback font! TTF_Error: " << TTF_GetError() << std::endl;
-                return false;
-            }
+    // SDL_mixer does not report the buffer the device was opened with, so it
+    // is read from the length of the first mix callback.
+    bool openAudio(int bufferFrames) {
+        if (Mix_OpenAudio(AUDIO_FREQUENCY, AUDIO_F32SYS, AUDIO_CHANNELS, bufferFrames) < 0) {
+            std::cerr << "SDL_mixer could not initialize! Mix_Error: " << Mix_GetError() << std::endl;
+            return false;
         }
-        
-        if (currentBeatmap.loadFromFile(beatmapFile)) {
-            useRandomNotes = false;
-            std::cout << "Loaded beatmap: " << currentBeatmap.getTitle() << std::endl;
-            std::cout << "Music file: " << currentBeatmap.getMusicFile() << std::endl;
-            
-            loadMusic(currentBeatmap.getMusicFile());
-        } else {
-            useRandomNotes = true;
-            std::cout << "Using random note generation (beatmap file not found or invalid)" << std::endl;
+        audioBufferFrames = bufferFrames;
+        underrunsAtLastCheck = 0;
+        if (!songClock.attach() || !mixer.attach(songClock)) {
+            return false;
         }
-        
-        lastFrameTime = std::chrono::high_resolution_clock::now();
-        
+        hitsounds.load(mixer.getChannels());
+
+        Uint32 probeStart = SDL_GetTicks();
+        while (songClock.getBufferFrames() == 0 && SDL_GetTicks() - probeStart < AUDIO_PROBE_TIMEOUT_MS) {
+            SDL_Delay(1);
+        }
+        std::cout << "Audio: " << songClock.getFrequency() << " Hz, " << songClock.getChannels()
+                  << " channels, " << songClock.getBufferFrames() << "-frame buffer (requested "
+                  << bufferFrames << "), output latency " << songClock.getOutputLatency() * 1000.0
+                  << " ms" << std::endl;
         return true;
     }
 
-    bool loadMusic(const std::string& musicPath) {
-        if (music != nullptr) {
-            Mix_FreeMusic(music);
-            music = nullptr;
+    void closeAudio() {
+        mixer.detach();
+        keysounds.stop();
+        hitsounds.unload();
+        unloadMusic();
+        songClock.detach();
+        Mix_CloseAudio();
+    }
+
+    // At the end of a play: if the device underran too often since the last
+    // check, reopen it with the next larger buffer and reload the music into
+    // it.
+    bool checkAudioUnderruns() {
+        // A loader may be writing the track; check again after the next play.
+        if (isLoading()) {
+            return true;
         }
-        
-        // Load the music file
-        music = Mix_LoadMUS(musicPath.c_str());
-        if (music == nullptr) {
-            std::cerr << "Failed to load music! Mix_Error: " << Mix_GetError() << std::endl;
-            musicLoaded = false;
+
+        uint32_t underruns = songClock.getUnderruns();
+        uint32_t recent = underruns - underrunsAtLastCheck;
+        underrunsAtLastCheck = underruns;
+        if (recent < AUDIO_UNDERRUN_FALLBACK || audioBufferFrames >= MAX_AUDIO_BUFFER_FRAMES) {
+            return true;
+        }
+
+        std::cout << recent << " audio underruns with a " << audioBufferFrames
+                  << "-frame buffer, reopening with " << audioBufferFrames * 2 << std::endl;
+        bool reloadMusic = isMusicReady();
+        stopMusic();
+        closeAudio();
+        if (!openAudio(audioBufferFrames * 2)) {
             return false;
         }
-        
-        musicLoaded = true;
-        std::cout << "Music loaded successfully: " << musicPath << std::endl;
+        if (reloadMusic) {
+            // Already decoded for this rate, so this is only a cache lookup.
+            requestMusic();
+            musicLoad.wait();
+            loadKeysounds();
+        }
         return true;
     }
+
+    // The atlas is rasterised on a loader thread once the font is open;
+    // pollAssets() uploads it.
+    void requestFont() {
+        fontLoad = assets.submit([]() {
+            TTF_Font* loaded = TTF_OpenFont("fonts/arial.ttf", 24);
+            if (loaded == nullptr) {
+                std::cerr << "Failed to load font! TTF_Error: " << TTF_GetError() << std::endl;
+
+                loaded = TTF_OpenFont("fonts/FreeSans.ttf", 24);
+                if (loaded == nullptr) {
+                    std::cerr << "Failed to load fallback font! TTF_Error: " << TTF_GetError() << std::endl;
+                }
+            }
+            return loaded;
+        });
+        std::shared_future<TTF_Font*> opened = fontLoad;
+        atlasLoad = assets.submit([this, opened]() {
+            TTF_Font* loaded = opened.get();
+            return loaded != nullptr && glyphAtlas.rasterize(loaded);
+        }, fontLoad);
+        atlasPending = true;
+    }
+
+    // Parses beatmapFile into a new chart, then loads the music it names;
+    // a generated stress chart has none. The previous chart is kept alive
+    // by anything still holding it and is never modified; pollAssets()
+    // switches over once the parse is done.
+    void requestChart() {
+        std::string path = beatmapFile;
+        size_t generatedNotes = stressNotes;
+        chartLoad = assets.submit([path, generatedNotes]() -> std::shared_ptr<const Beatmap> {
+            std::shared_ptr<Beatmap> loaded = std::make_shared<Beatmap>();
+            if (generatedNotes > 0) {
+                std::string text = generateSyntheticBeatmapText(generatedNotes, STRESS_NOTE_INTERVAL);
+                if (!loaded->parseText(text.data(), text.size(), "stress chart")) {
+                    return nullptr;
+                }
+            } else if (!loaded->loadFromFile(path)) {
+                return nullptr;
+            }
+            return loaded;
+        });
+        chartPending = true;
+        if (generatedNotes > 0) {
+            unloadMusic();
+        } else {
+            requestMusic();
+        }
+    }
+
+    void requestMusic() {
+        unloadMusic();
+
+        std::shared_future<std::shared_ptr<const Beatmap>> parsed = chartLoad;
+        int frequency = songClock.getFrequency();
+        int channels = mixer.getChannels();
+        bool useCache = useMusicCache;
+        musicLoad = assets.submit([this, parsed, frequency, channels, useCache]() {
+            std::shared_ptr<const Beatmap> loaded = parsed.get();
+            return loaded != nullptr && music.load(loaded->getMusicFile(), frequency, channels, useCache);
+        }, chartLoad);
+        musicPending = true;
+    }
+
+    // Main thread, once per frame: takes over whatever has finished loading.
+    void pollAssets() {
+        if (atlasPending && AssetManager::isReady(atlasLoad)) {
+            atlasPending = false;
+            font = fontLoad.get();
+            if (!atlasLoad.get() || !glyphAtlas.upload(renderer)) {
+                std::cerr << "No font to draw text with" << std::endl;
+                shutdown();
+            } else {
+                // The static layer was first built without text; add the key labels.
+                buildPlayfieldLayers();
+            }
+        }
+
+        if (chartPending && AssetManager::isReady(chartLoad)) {
+            chartPending = false;
+            std::shared_ptr<const Beatmap> loaded = chartLoad.get();
+            if (loaded != nullptr) {
+                chart = loaded;
+                useRandomNotes = false;
+                std::cout << "Loaded beatmap: " << chart->getTitle() << std::endl;
+                if (!chart->getMusicFile().empty()) {
+                    std::cout << "Music file: " << chart->getMusicFile() << std::endl;
+                }
+                loadKeysounds();
+            } else {
+                useRandomNotes = true;
+                std::cout << "Using random note generation (beatmap file not found or invalid)" << std::endl;
+            }
+        }
+
+        if (musicPending && !chartPending && AssetManager::isReady(musicLoad)) {
+            musicPending = false;
+            if (musicLoad.get()) {
+                std::cout << "Music loaded successfully: " << chart->getMusicFile() << std::endl;
+            }
+        }
+    }
+
+    bool isLoading() const {
+        return chartPending || (musicPending && !AssetManager::isReady(musicLoad));
+    }
+
+    bool isMusicReady() const {
+        return AssetManager::isReady(musicLoad) && musicLoad.get();
+    }
+
+    // Sample names in a chart are relative to the chart file. Samples of the
+    // previous chart are freed, so any still ringing are cut first.
+    void loadKeysounds() {
+        mixer.stopNow(FIRST_KEYSOUND_VOICE, KEYSOUND_VOICES);
+        keysoundVoices.reset();
+        keysounds.start(*chart, std::filesystem::path(beatmapFile).parent_path().string(), mixer.getChannels());
+        if (!keysounds.empty()) {
+            std::cout << "Keysounds: " << chart->getSampleCount() << " samples" << std::endl;
+        }
+    }
+
+    // Waits for a load in progress. The music voice is stopped before the
+    // samples go, since stopMusic() only queues the stop for the callback.
+    void unloadMusic() {
+        if (musicLoad.valid()) {
+            musicLoad.wait();
+            musicLoad = std::shared_future<bool>();
+        }
+        musicPending = false;
+        mixer.stopNow(MUSIC_VOICE, 1);
+        music.unload();
+        musicPlaying = false;
+    }
     
     void cleanup() {
         std::cout << "Performing cleanup..." << std::endl;
-    
-        notes.clear();
-    
-        if (music != nullptr) {
-            Mix_HaltMusic();
-            Mix_FreeMusic(music);
-            music = nullptr;
+
+        assets.stop();
+        replay.stop();
+        if (font == nullptr && fontLoad.valid()) {
+            font = fontLoad.get();
         }
+    
+        engine.clearNotes();
         
+        destroyPlayfieldLayers();
+        glyphAtlas.destroy();
+
         if (font != nullptr) {
             TTF_CloseFont(font);
             font = nullptr;
@@ -360,7 +4023,7 @@ private:
             window = nullptr;
         }
         
-        Mix_CloseAudio();
+        closeAudio();
         TTF_Quit();
         SDL_Quit();
     
@@ -372,12 +4035,21 @@ private:
     }
     
     void run() {
-    
-        SDL_Event e;
-        
         while (gameRunning) {
-            while (SDL_PollEvent(&e)) {
-                handleEvent(e);
+            // Counts the whole iteration, from input handling to the wait.
+            uint64_t allocationsBefore = heapAllocationCount;
+
+            {
+                FrameProfiler::Scope scope(profiler, ProfileStage::EVENTS);
+                captureInput();
+                if (autoplay && gameStarted && !gameEnded) {
+                    queueAutoplay(SDL_GetPerformanceCounter());
+                }
+
+                TimedEvent timed;
+                while (inputQueue.pop(timed)) {
+                    handleEvent(timed.event, timed.timestamp);
+                }
             }
 
             if (!gameRunning) {
@@ -385,32 +4057,240 @@ private:
                 break;
             }
             
-            auto currentTime = std::chrono::high_resolution_clock::now();
-            float deltaTime = std::chrono::duration<float>(currentTime - lastFrameTime).count();
-            lastFrameTime = currentTime;
-            
+            pollAssets();
+            if (benchmarkSeconds > 0.0) {
+                updateBenchmark();
+            }
+
+            frameArena.reset();
+
             if (gameStarted) {
-                update(deltaTime);
+                FrameProfiler::Scope scope(profiler, ProfileStage::UPDATE);
+                runSimulation(SDL_GetPerformanceCounter());
             }
             
-            render();
+            {
+                FrameProfiler::Scope scope(profiler, ProfileStage::RENDER);
+                render();
+            }
             
-            SDL_Delay(16);   //this is for the game to run at 60 FPS
+            {
+                FrameProfiler::Scope scope(profiler, ProfileStage::WAIT);
+                frameLimiter.wait([this]() { captureInput(); });
+            }
+
+            profiler.setAudioUnderruns(songClock.getUnderruns());
+            profiler.setDroppedInputs(droppedInputEvents);
+            profiler.endFrame();
 
-            static int frameCount = 0;
-            frameCount++;
-            if (frameCount % 300 == 0) {
-                std::cout << "Frame: " << frameCount << std::endl;
+            if (gameStarted) {
+                checkFrameAllocations(heapAllocationCount - allocationsBefore);
             }
         }
 
         std::cout << "Game loop ended, cleaning up" << std::endl;
     }
     
-    void handleEvent(SDL_Event& e) {
+    // Polls SDL and stamps each event with the performance counter. Called at
+    // the start of every frame and repeatedly while the frame limiter waits,
+    // so a key press is timed to within about a millisecond rather than a
+    // frame. SDL only delivers window events on the thread that created the
+    // window, so this stays on the main thread; the queue would let it move.
+    void captureInput() {
+        SDL_Event e;
+        while (SDL_PollEvent(&e)) {
+            TimedEvent timed = {e, SDL_GetPerformanceCounter()};
+            if (!inputQueue.push(timed)) {
+                droppedInputEvents++;
+            }
+        }
+    }
+
+    // Once play has warmed up (queues grown, scratch buffers sized), a frame
+    // should not allocate at all. In strict mode the first one that does
+    // ends the session so main() can report a failure.
+    void checkFrameAllocations(uint64_t allocations) {
+        if (++playFrames <= ALLOCATION_WARMUP_FRAMES || allocations == 0) {
+            return;
+        }
+
+        if (steadyStateAllocations == 0) {
+            std::cerr << "Heap allocation during gameplay: " << allocations
+                      << " in play frame " << playFrames << std::endl;
+        }
+        steadyStateAllocations += allocations;
+
+        if (strictAllocations) {
+            shutdown();
+        }
+    }
+
+    // Pushes key events for every charted note due by `now` onto the input
+    // queue, stamped with the exact counter time of the note, so they take
+    // the same path as the keyboard and are judged PERFECT. Each key is held
+    // for AUTOPLAY_HOLD, or until the next note in its column.
+    void queueAutoplay(Uint64 now) {
+        if (useRandomNotes) return;
+
+        const float* times = chart->getNoteTimes();
+        const uint8_t* columns = chart->getNoteColumns();
+        double horizon = songClock.getTime(now);
+        for (;;) {
+            int releaseColumn = 0;
+            for (int i = 1; i < COLUMN_COUNT; i++) {
+                if (autoplayRelease[i] < autoplayRelease[releaseColumn]) {
+                    releaseColumn = i;
+                }
+            }
+            double releaseTime = autoplayRelease[releaseColumn];
+            double noteTime = autoplayNote < chart->getNoteCount()
+                                  ? static_cast<double>(times[autoplayNote]) + chart->getOffset()
+                                  : std::numeric_limits<double>::infinity();
+            if (std::min(releaseTime, noteTime) > horizon) {
+                break;
+            }
+
+            if (releaseTime <= noteTime) {
+                queueAutoplayKey(releaseColumn, releaseTime, false);
+                autoplayRelease[releaseColumn] = std::numeric_limits<double>::infinity();
+                continue;
+            }
+
+            int column = columns[autoplayNote++];
+            if (autoplayRelease[column] != std::numeric_limits<double>::infinity()) {
+                queueAutoplayKey(column, noteTime, false);
+            }
+            queueAutoplayKey(column, noteTime, true);
+            autoplayRelease[column] = noteTime + AUTOPLAY_HOLD;
+        }
+    }
+
+    void queueAutoplayKey(int column, double time, bool down) {
+        SDL_Event e = {};
+        e.type = down ? SDL_KEYDOWN : SDL_KEYUP;
+        e.key.state = down ? SDL_PRESSED : SDL_RELEASED;
+        e.key.keysym.sym = KEY_BINDINGS[column];
+        TimedEvent timed = {e, songClock.getCounterAtTime(time)};
+        if (!inputQueue.push(timed)) {
+            droppedInputEvents++;
+        }
+    }
+
+    // --benchmark: starts the chart as soon as it has loaded, restarts it
+    // whenever it ends, and after benchmarkSeconds writes the report and
+    // quits.
+    void updateBenchmark() {
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (!benchmarkRunning) {
+            if (atlasPending || isLoading()) return;
+            startGame();
+            if (!gameStarted) return;
+
+            benchmarkRunning = true;
+            benchmarkStart = now;
+            benchmarkAllocations = heapAllocationCount;
+            steadyStateAllocations = 0;
+            profiler.beginRun();
+            return;
+        }
+
+        if (gameEnded) {
+            benchmarkPlays++;
+            retry();
+        }
+
+        double elapsed = static_cast<double>(now - benchmarkStart) / SDL_GetPerformanceFrequency();
+        if (elapsed >= benchmarkSeconds) {
+            writeBenchmarkReport(elapsed);
+            shutdown();
+        }
+    }
+
+    void writeBenchmarkReport(double elapsed) {
+        std::ofstream out(benchmarkOutput);
+        if (!out.is_open()) {
+            std::cerr << "Failed to write benchmark report: " << benchmarkOutput << std::endl;
+            return;
+        }
+
+        const PlayState& play = engine.getState();
+        SDL_RendererInfo rendererInfo = {};
+        SDL_GetRendererInfo(renderer, &rendererInfo);
+        uint64_t allocations = heapAllocationCount - benchmarkAllocations;
+        const char* indent = "  ";
+
+        out << "{\n";
+        out << indent << "\"chart\": ";
+        writeJsonString(out, useRandomNotes ? "generated notes" : chart->getTitle());
+        out << ",\n";
+        out << indent << "\"notes\": " << (useRandomNotes ? 0 : chart->getNoteCount()) << ",\n";
+        out << indent << "\"autoplay\": " << (autoplay ? "true" : "false") << ",\n";
+        out << indent << "\"video_driver\": ";
+        writeJsonString(out, SDL_GetCurrentVideoDriver() != nullptr ? SDL_GetCurrentVideoDriver() : "");
+        out << ",\n";
+        out << indent << "\"renderer\": ";
+        writeJsonString(out, rendererInfo.name != nullptr ? rendererInfo.name : "");
+        out << ",\n";
+        out << indent << "\"seconds\": " << elapsed << ",\n";
+        out << indent << "\"completed_plays\": " << benchmarkPlays << ",\n";
+        profiler.writeRunJson(out, indent);
+        out << ",\n";
+        out << indent << "\"allocations\": {\"total\": " << allocations << ", \"per_frame\": "
+            << static_cast<double>(allocations) / std::max<int64_t>(profiler.getRunFrames(), 1)
+            << ", \"steady_state\": " << steadyStateAllocations << "},\n";
+        out << indent << "\"judgments\": {\"score\": " << play.score << ", \"max_combo\": " << play.maxCombo
+            << ", \"accuracy\": " << play.getAccuracy() << ", \"perfect\": " << play.perfectHits
+            << ", \"great\": " << play.greatHits << ", \"good\": " << play.goodHits
+            << ", \"miss\": " << play.missedHits << "}\n";
+        out << "}\n";
+
+        std::cout << "Benchmark report written to " << benchmarkOutput << std::endl;
+    }
+
+    void setStrictAllocations(bool strict) { strictAllocations = strict; }
+
+    void setAutoplay(bool enabled) { autoplay = enabled; }
+
+    // Must be called before initialize(). Runs for `seconds` on SDL's dummy
+    // video and audio drivers with the software renderer, then writes a
+    // JSON report to `output`.
+    void setBenchmark(double seconds, const std::string& output) {
+        benchmarkSeconds = seconds;
+        benchmarkOutput = output;
+    }
+
+    // Must be called before initialize(). Plays a generated chart of `notes`
+    // notes, STRESS_NOTE_INTERVAL apart, instead of the beatmap file.
+    void setStressChart(size_t notes) { stressNotes = notes; }
+
+    void setJudgmentWindows(const JudgmentWindows& windows) { engine.setJudgmentWindows(windows); }
+
+    // Must be called before initialize(). Grows on its own if the device underruns.
+    void setAudioBufferFrames(int frames) { audioBufferFrames = frames; }
+
+    void setKeysoundBudget(size_t bytes) { keysounds.setBudget(bytes); }
+
+    // Must be called before initialize().
+    void setMusicCache(bool enabled) { useMusicCache = enabled; }
+
+    // Must be called before initialize(); vsync is fixed when the renderer is created.
+    void setFramePacing(FramePacing pacing, int fps) {
+        framePacing = pacing;
+        targetFps = fps;
+    }
+    uint64_t getSteadyStateAllocations() const { return steadyStateAllocations; }
+
+    void handleEvent(const SDL_Event& e, Uint64 timestamp) {
         if (e.type == SDL_QUIT) {
             shutdown();
         }
+        else if (e.type == SDL_RENDER_TARGETS_RESET || e.type == SDL_RENDER_DEVICE_RESET) {
+            // Target texture contents are lost; the atlas itself survives a targets reset.
+            if (e.type == SDL_RENDER_DEVICE_RESET && font != nullptr) {
+                glyphAtlas.build(renderer, font);
+            }
+            buildPlayfieldLayers();
+        }
         else if (e.type == SDL_KEYDOWN) {
 
             if (e.key.keysym.sym == SDLK_ESCAPE) {
@@ -418,328 +4298,243 @@ private:
             }
 
             else if (gameEnded) {
-                if (e.key.keysym.sym == SDLK_SPACE) {
-                    gameEnded = false; 
-                    resetStats();      
-                    startGame();       
+                if (e.key.keysym.sym == SDLK_SPACE || e.key.keysym.sym == SDLK_r) {
+                    retry();
                 }
                 return;
             }
 
-            else if (e.key.keysym.sym == SDLK_r && !gameEnded) {
+            else if (e.key.keysym.sym == SDLK_r) {
+                retry();
+            }
+            else if (e.key.keysym.sym == SDLK_F5) {
+                replay.end();
                 stopMusic();
                 resetStats();
                 gameStarted = false;
-                if (currentBeatmap.loadFromFile(beatmapFile)) {
-                    useRandomNotes = false;
-                    std::cout << "Reloaded beatmap: " << currentBeatmap.getTitle() << std::endl;
-                } else {
-                    useRandomNotes = true;
-                    std::cout << "Using random note generation (beatmap reload failed)" << std::endl;
-                }
+                requestChart();
             }
             else if (e.key.keysym.sym == SDLK_SPACE && !gameStarted && !gameEnded) {
                 startGame();
             }
+            else if (e.key.keysym.sym == SDLK_F3) {
+                changeScrollSpeed(-NOTE_SPEED_STEP);
+            }
+            else if (e.key.keysym.sym == SDLK_F4) {
+                changeScrollSpeed(NOTE_SPEED_STEP);
+            }
             
             if (gameStarted && !gameEnded) {
                 for (int i = 0; i < COLUMN_COUNT; i++) {
                     if (e.key.keysym.sym == KEY_BINDINGS[i] && !keyStates[i]) {
                         keyStates[i] = true;
-                        handleKeyPress(i);
+                        if (keysounds.empty()) {
+                            hitsounds.play(timestamp, songClock, mixer);
+                        }
+                        ColumnPress press = {i, songClock.getTime(timestamp)};
+                        replay.record(i, press.time, true);
+                        if (!columnPresses.push(press)) {
+                            droppedInputEvents++;
+                        }
                     }
                 }
             }
         } else if (e.type == SDL_KEYUP) {
             for (int i = 0; i < COLUMN_COUNT; i++) {
                 if (e.key.keysym.sym == KEY_BINDINGS[i]) {
+                    if (keyStates[i] && gameStarted && !gameEnded) {
+                        replay.record(i, songClock.getTime(timestamp), false);
+                    }
                     keyStates[i] = false;
                 }
             }
         }
     }
     
-    void startGame() {
-        gameStarted = true;
-        resetStats();
-        gameStartTime = std::chrono::high_resolution_clock::now();
-        gameTime = 0.0f;
-
-        if (musicLoaded && !useRandomNotes) {
-            playMusic();
-            musicStartTime = 0.0f;
-        }
+    // Starts the chart over from any state: the play state is reset and the
+    // music voice restarted from its first frame. Nothing is read from or
+    // written to disk, and no thread is started.
+    void retry() {
+        stopMusic();
+        startGame();
     }
 
-    void playMusic() {
-        if (music != nullptr) {
-            Mix_PlayMusic(music, 0);
-            musicPlaying = true;
-            std::cout << "Music playback started" << std::endl;
-        }
-    }
-    
-    void stopMusic() {
-        if (musicPlaying) {
-            Mix_HaltMusic();
-            musicPlaying = false;
+    void startGame() {
+        if (isLoading()) {
+            std::cout << "Still loading the beatmap" << std::endl;
+            return;
         }
-    }
-    
-    void resetStats() {
-        score = 0;
-        combo = 0;
-        maxCombo = 0;
-        totalHits = 0;
-        perfectHits = 0;
-        greatHits = 0;
-        goodHits = 0;
-        missedHits = 0;
-        notes.clear();
-        gameTime = 0.0f;
-        gameEnded = false;
-        
-        std::uniform_real_distribution<float> timeDist(MIN_SPAWN_INTERVAL, MAX_SPAWN_INTERVAL);
-        nextGenerationInterval = timeDist(rng);
-        noteGenerationTimer = 0.0f;
-    }
-    
-    void update(float deltaTime) {
-        gameTime += deltaTime;
 
-        if (musicPlaying && !Mix_PlayingMusic()) {
-            musicPlaying = false;
-            std::cout << "Music playback ended" << std::endl;
-        }
-        
-        if (!useRandomNotes) {
-            float adjustedTime = gameTime - currentBeatmap.getOffset();
-            
-            std::vector<int> noteColumns = currentBeatmap.getNotesAtTime(adjustedTime);
-            for (int column : noteColumns) {
-                createNote(column);
-            }
-            
-            if (!currentBeatmap.hasMoreNotes() && notes.empty() && 
-                gameTime > (currentBeatmap.getSongLength() + currentBeatmap.getOffset()) && 
-                !musicPlaying) {
-                showResults();
-                gameStarted = false;
-                gameEnded = true;
-            }
-        } else {
-            noteGenerationTimer += deltaTime;
-            if (noteGenerationTimer > nextGenerationInterval) {
+        gameStarted = true;
+        playFrames = 0;
+        resetStats();
 
-                std::uniform_int_distribution<int> notesCountDist(MIN_NOTES_PER_SPAWN, MAX_NOTES_PER_SPAWN);
-                int notesToGenerate = notesCountDist(rng);
-                
-                generateNotePattern(notesToGenerate);
-                
-                noteGenerationTimer = 0.0f;
-                std::uniform_real_distribution<float> timeDist(MIN_SPAWN_INTERVAL, MAX_SPAWN_INTERVAL);
-                nextGenerationInterval = timeDist(rng);
-            }
+        bool withMusic = isMusicReady() && !useRandomNotes;
+        songClock.start(SDL_GetPerformanceCounter(), withMusic);
+        hitsounds.resetLatency();
+        if (withMusic) {
+            playMusic(songClock.getStartFrame());
         }
-        
-        for (auto& note : notes) {
-            if (!note.hit && !note.missed) {
-                note.position += NOTE_SPEED * deltaTime;
-                note.rect.y = static_cast<int>(note.position);
-                
-                if (note.position > JUDGMENT_LINE_Y + NOTE_HEIGHT * 2) {
-                    note.missed = true;
-                    handleMiss();
-                }
-            }
-        }
-        
-        if (currentJudgment.type != JudgmentType::NONE) {
-            currentJudgment.displayTime -= deltaTime;
-            if (currentJudgment.displayTime <= 0.0f) {
-                currentJudgment.type = JudgmentType::NONE;
-            }
+        if (!autoplay) {
+            beginReplay();
         }
-        
-        notes.erase(
-            std::remove_if(notes.begin(), notes.end(), 
-                [](const Note& note) { return note.hit || note.missed; }),
-            notes.end()
-        );
-    }
-    
-    void generateNotePattern(int notesCount) {
-        switch(notesCount) {
-            case 1:
-                {
-                    std::uniform_int_distribution<int> columnDist(0, COLUMN_COUNT - 1);
-                    int columnIndex = columnDist(rng);
-                    createNote(columnIndex);
-                }
-                break;
-            
-            case 2:
-                {
-                    std::uniform_int_distribution<int> patternDist(0, 1);
-                    int patternType = patternDist(rng);
-                    
-                    if (patternType == 0) {
-                        std::uniform_int_distribution<int> startColDist(0, COLUMN_COUNT - 2);
-                        int startCol = startColDist(rng);
-                        createNote(startCol);
-                        createNote(startCol + 1);
-                    } else {
-                        createNote(0);
-                        createNote(COLUMN_COUNT - 1);
-                    }
-                }
-                break;
-            
-            case 3:
-                {
-                    std::vector<int> availableCols;
-                    for (int i = 0; i < COLUMN_COUNT; i++) {
-                        availableCols.push_back(i);
-                    }
-                    
-                    std::shuffle(availableCols.begin(), availableCols.end(), rng);
-                    
-                    for (int i = 0; i < 3 && i < COLUMN_COUNT; i++) {
-                        createNote(availableCols[i]);
-                    }
-                }
-                break;
-                
-            default:
-                {
-                    std::uniform_int_distribution<int> columnDist(0, COLUMN_COUNT - 1);
-                    int columnIndex = columnDist(rng);
-                    createNote(columnIndex);
-                }
-                break;
+    }
+
+    // The header holds everything besides the key events that decides how
+    // the play is judged.
+    void beginReplay() {
+        const JudgmentWindows& windows = engine.getJudgmentWindows();
+        ReplayHeader header = {};
+        std::memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+        header.version = REPLAY_VERSION;
+        header.chartHash = useRandomNotes ? 0 : replayChartHash(*chart);
+        header.seed = playSeed;
+        header.columns = COLUMN_COUNT;
+        header.perfectMs = windows.perfectMs;
+        header.greatMs = windows.greatMs;
+        header.goodMs = windows.goodMs;
+        header.missMs = windows.missMs;
+        header.scrollSpeed = scrollSpeed;
+        replay.begin(header);
+    }
+
+    void playMusic(uint64_t startFrame) {
+        if (isMusicReady()) {
+            mixer.play(MUSIC_VOICE, music.getSamples(), music.getFrameCount(), startFrame, MUSIC_GAIN);
+            musicEndFrame = startFrame + music.getFrameCount();
+            musicPlaying = true;
+            std::cout << "Music playback started" << std::endl;
         }
     }
     
-    void createNote(int columnIndex) {
-        Note note;
-        note.position = 0;
-        note.column = columnIndex;
-        note.hit = false;
-        note.missed = false;
-        
-        int noteWidth = static_cast<int>(columnWidth) - 10;
-        note.rect.x = static_cast<int>(columnIndex * columnWidth) + 5;
-        note.rect.y = 0;
-        note.rect.w = noteWidth;
-        note.rect.h = NOTE_HEIGHT;
-        
-        switch (columnIndex) {
-            case 0: note.color = {255, 100, 100, 255}; break; // red
-            case 1: note.color = {100, 255, 100, 255}; break; // green
-            case 2: note.color = {100, 100, 255, 255}; break; // blue
-            case 3: note.color = {255, 255, 100, 255}; break; // yellow
-            default: note.color = {255, 255, 255, 255}; break;
+    void stopMusic() {
+        if (musicPlaying) {
+            mixer.stop(MUSIC_VOICE);
+            musicPlaying = false;
         }
-        
-        notes.push_back(note);
     }
     
-    void handleKeyPress(int columnIndex) {
-        if (!gameStarted) return;
-        
-        Note* closestNote = nullptr;
-        float closestDistance = std::numeric_limits<float>::max();
-        
-        for (auto& note : notes) {
-            if (note.column == columnIndex && !note.hit && !note.missed) {
-                float distance = std::abs(note.position - JUDGMENT_LINE_Y);
-                if (distance < closestDistance) {
-                    closestDistance = distance;
-                    closestNote = &note;
-                }
+    void resetStats() {
+        engine.setChart(useRandomNotes ? nullptr : chart);
+        playSeed = static_cast<uint32_t>(seedSource());
+        engine.seed(playSeed);
+        engine.reset();
+        keysounds.rewind();
+        keysoundVoices.reset();
+        columnPresses.clear();
+        gameEnded = false;
+
+        // Let go of any key autoplay still holds from the last play.
+        autoplayNote = 0;
+        for (int i = 0; i < COLUMN_COUNT; i++) {
+            if (autoplayRelease[i] != std::numeric_limits<double>::infinity()) {
+                keyStates[i] = false;
+                autoplayRelease[i] = std::numeric_limits<double>::infinity();
             }
         }
-        
-        if (closestNote != nullptr && closestDistance < GOOD_WINDOW) {
-            closestNote->hit = true;
-            totalHits++;
-            
-            if (closestDistance < PERFECT_WINDOW) {
-                showJudgment(JudgmentType::PERFECT);
-                score += 300 + combo * 5;
-                combo++;
-                perfectHits++;
-            } else if (closestDistance < GREAT_WINDOW) {
-                showJudgment(JudgmentType::GREAT);
-                score += 200 + combo * 3;
-                combo++;
-                greatHits++;
-            } else {
-                showJudgment(JudgmentType::GOOD);
-                score += 100 + combo;
-                combo++;
-                goodHits++;
+    }
+    
+    // Advances the engine in fixed SIMULATION_STEP ticks up to the game time
+    // at `now`, so spawning, misses and judgments do not depend on the frame
+    // rate. What is left over is used to interpolate rendering; a long hitch
+    // is worked off over several frames rather than dropped. The play ends
+    // once the chart is done and the music has stopped.
+    void runSimulation(Uint64 now) {
+        if (musicPlaying && songClock.getMixedFrames() >= musicEndFrame) {
+            musicPlaying = false;
+            songClock.stopFollowingAudio();
+            std::cout << "Music playback ended" << std::endl;
+        }
+
+        songClock.update(now);
+        hitsounds.measureLatency(songClock);
+        engine.advance(songClock.getTime(now), MAX_SIMULATION_TICKS_PER_FRAME, columnPresses,
+                       [this](const ColumnPress& press, const PressResult& result, float songTime) {
+            if (result.type != JudgmentType::NONE) {
+                playKeysound(press.column, result.noteTime, songTime);
             }
-            
-            if (combo > maxCombo) {
-                maxCombo = combo;
+        });
+
+        if (engine.isFinished() && !musicPlaying) {
+            replay.end();
+            showResults();
+            gameStarted = false;
+            gameEnded = true;
+            // Here rather than when the next play starts, so a reopened
+            // device does not hitch a retry.
+            if (!checkAudioUnderruns()) {
+                shutdown();
             }
+            return;
+        }
+
+        if (!useRandomNotes) {
+            keysounds.prefetch(*chart, engine.getSongTime(), songClock.getMixedFrames());
         }
     }
-    
-    void handleMiss() {
-        showJudgment(JudgmentType::MISS);
-        combo = 0;
-        totalHits++;
-        missedHits++;
+
+    // Time a note needs to scroll from just above the screen to the judgment line.
+    float getSpawnLeadTime() const {
+        return (JUDGMENT_LINE_Y + NOTE_HEIGHT) / scrollSpeed;
     }
-    
-    void showJudgment(JudgmentType type) {
-        currentJudgment.type = type;
-        currentJudgment.displayTime = 0.5f;
-        
-        switch (type) {
-            case JudgmentType::PERFECT:
-                currentJudgment.text = "PERFECT";
-                currentJudgment.color = {255, 230, 0, 255}; // gold
-                break;
-            case JudgmentType::GREAT:
-                currentJudgment.text = "GREAT";
-                currentJudgment.color = {0, 255, 0, 255}; // green
-                break;
-            case JudgmentType::GOOD:
-                currentJudgment.text = "GOOD";
-                currentJudgment.color = {0, 200, 255, 255}; // blue
-                break;
-            case JudgmentType::MISS:
-                currentJudgment.text = "MISS";
-                currentJudgment.color = {255, 0, 0, 255}; // red
-                break;
-            default:
-                break;
-        }
+
+    void changeScrollSpeed(int delta) {
+        scrollSpeed = std::clamp(scrollSpeed + delta, static_cast<float>(MIN_NOTE_SPEED),
+                                 static_cast<float>(MAX_NOTE_SPEED));
+        engine.setSpawnLeadTime(getSpawnLeadTime());
+        std::cout << "Scroll speed: " << scrollSpeed << " px/s" << std::endl;
     }
     
+    // Plays the keysound of the note at hitTime in columnIndex, timed to the
+    // press at pressSongTime the way hitsounds are timed to the key.
+    void playKeysound(int columnIndex, float hitTime, float pressSongTime) {
+        const uint16_t* samples = chart->getNoteSamples();
+        if (samples == nullptr || useRandomNotes) return;
+
+        size_t note = chart->findNote(hitTime, columnIndex);
+        if (note == chart->getNoteCount()) return;
+
+        uint64_t mixedFrames = songClock.getMixedFrames();
+        double pressGameTime = static_cast<double>(pressSongTime) + chart->getOffset();
+        uint64_t startFrame = std::max(songClock.getMixerFrameAtTime(pressGameTime) + songClock.getBufferFrames(),
+                                       mixedFrames);
+        keysounds.play(samples[note], startFrame, mixedFrames, mixer, keysoundVoices);
+    }
+
     void showResults() {
+        engine.computeHitErrorStats();
+        const PlayState& play = engine.getState();
         std::cout << "\n===== RESULTS =====\n";
-        std::cout << "Score: " << score << std::endl;
-        std::cout << "Max Combo: " << maxCombo << "x" << std::endl;
+        std::cout << "Score: " << play.score << std::endl;
+        std::cout << "Max Combo: " << play.maxCombo << "x" << std::endl;
         
-        float accuracy = 100.0f;
-        if (totalHits > 0) {
-            accuracy = (perfectHits * 300.0f + greatHits * 200.0f + goodHits * 100.0f) / 
-                      (totalHits * 300.0f) * 100.0f;
+        std::cout << "Accuracy: " << play.getAccuracy() << "%" << std::endl;
+        std::cout << "Perfect: " << play.perfectHits << std::endl;
+        std::cout << "Great: " << play.greatHits << std::endl;
+        std::cout << "Good: " << play.goodHits << std::endl;
+        std::cout << "Miss: " << play.missedHits << std::endl;
+
+        std::cout << "Mean error: " << play.hitErrorMean << " ms" << std::endl;
+        std::cout << "Unstable rate: " << play.unstableRate << std::endl;
+        std::cout << "Audio drift: mean " << songClock.getMeanDrift() * 1000.0
+                  << " ms, max " << songClock.getMaxDrift() * 1000.0 << " ms, "
+                  << songClock.getSnapCount() << " resyncs" << std::endl;
+        std::cout << "Hitsound latency: mean " << hitsounds.getMeanLatency() * 1000.0
+                  << " ms, max " << hitsounds.getMaxLatency() * 1000.0 << " ms over "
+                  << hitsounds.getLatencySamples() << " hits" << std::endl;
+        if (!keysounds.empty()) {
+            std::cout << "Keysounds: " << keysounds.getLateSamples() << " not ready in time, "
+                      << keysounds.getEvictions() << " evicted, "
+                      << keysounds.getResidentBytes() / (1024.0 * 1024.0) << " MB resident, "
+                      << keysoundVoices.getSteals() << " voices stolen" << std::endl;
         }
-        
-        std::cout << "Accuracy: " << accuracy << "%" << std::endl;
-        std::cout << "Perfect: " << perfectHits << std::endl;
-        std::cout << "Great: " << greatHits << std::endl;
-        std::cout << "Good: " << goodHits << std::endl;
-        std::cout << "Miss: " << missedHits << std::endl;
         std::cout << "==================\n";
     }
     
-    void render() {
+    // Column borders, key areas, key labels and the judgment line. The
+    // playfield layers are built from this; it is only called per frame when
+    // render targets are unavailable.
+    void drawPlayfield(const bool* pressed) {
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
         
@@ -754,21 +4549,16 @@ private:
             };
             SDL_RenderDrawRect(renderer, &columnRect);
             
-            SDL_Rect keyRect = {
-                static_cast<int>(i * columnWidth),
-                JUDGMENT_LINE_Y,
-                static_cast<int>(columnWidth),
-                KEY_AREA_HEIGHT
-            };
+            SDL_Rect keyRect = getKeyAreaRect(i);
             
-            if (keyStates[i]) {
+            if (pressed[i]) {
                 SDL_SetRenderDrawColor(renderer, 66, 135, 245, 200);
             } else {
                 SDL_SetRenderDrawColor(renderer, 30, 30, 30, 200);
             }
             SDL_RenderFillRect(renderer, &keyRect);
             
-            std::string keyText;
+            const char* keyText;
             switch (KEY_BINDINGS[i]) {
                 case SDLK_d: keyText = "D"; break;
                 case SDLK_f: keyText = "F"; break;
@@ -785,40 +4575,167 @@ private:
         SDL_SetRenderDrawColor(renderer, 100, 100, 100, 255);
         SDL_Rect lineRect = {0, JUDGMENT_LINE_Y, SCREEN_WIDTH, 3};
         SDL_RenderFillRect(renderer, &lineRect);
-        
-        for (const auto& note : notes) {
-            if (!note.hit && !note.missed) {
-                SDL_SetRenderDrawColor(renderer, note.color.r, note.color.g, note.color.b, note.color.a);
-                SDL_RenderFillRect(renderer, &note.rect);
+    }
+
+    SDL_Rect getKeyAreaRect(int column) const {
+        return {
+            static_cast<int>(column * columnWidth),
+            JUDGMENT_LINE_Y,
+            static_cast<int>(columnWidth),
+            KEY_AREA_HEIGHT
+        };
+    }
+
+    // The playfield never changes apart from which keys are held, so it is
+    // drawn once into two target textures: every key idle, and every key
+    // pressed. Without render-target support the playfield is drawn directly.
+    void buildPlayfieldLayers() {
+        destroyPlayfieldLayers();
+        if (!SDL_RenderTargetSupported(renderer)) {
+            std::cout << "Render targets unsupported, drawing the playfield every frame" << std::endl;
+            return;
+        }
+
+        bool pressed[COLUMN_COUNT];
+        for (int layer = 0; layer < 2; layer++) {
+            playfieldLayers[layer] = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET,
+                                                       SCREEN_WIDTH, SCREEN_HEIGHT);
+            if (playfieldLayers[layer] == nullptr) {
+                std::cerr << "Unable to create playfield layer! SDL_Error: " << SDL_GetError() << std::endl;
+                destroyPlayfieldLayers();
+                break;
             }
+            // Copied over the whole back buffer, or one key area, each frame,
+            // so copies replace what is there rather than blend in the
+            // translucent key fills.
+            SDL_SetTextureBlendMode(playfieldLayers[layer], SDL_BLENDMODE_NONE);
+
+            std::fill(pressed, pressed + COLUMN_COUNT, layer == 1);
+            SDL_SetRenderTarget(renderer, playfieldLayers[layer]);
+            drawPlayfield(pressed);
+            flushText();
         }
-        
-        renderText("Score: " + std::to_string(score), 10, 10, {255, 255, 255, 255});
-        renderText("Combo: " + std::to_string(combo) + "x", 10, 40, {255, 255, 255, 255});
-        
-        float accuracy = 100.0f;
-        if (totalHits > 0) {
-            accuracy = (perfectHits * 300.0f + greatHits * 200.0f + goodHits * 100.0f) / 
-                      (totalHits * 300.0f) * 100.0f;
+        SDL_SetRenderTarget(renderer, nullptr);
+    }
+
+    void destroyPlayfieldLayers() {
+        for (SDL_Texture*& layer : playfieldLayers) {
+            if (layer != nullptr) {
+                SDL_DestroyTexture(layer);
+                layer = nullptr;
+            }
+        }
+    }
+
+    // One copy of the idle layer, plus one copy per held key of its key area
+    // from the pressed layer.
+    void renderPlayfield() {
+        if (playfieldLayers[0] == nullptr || playfieldLayers[1] == nullptr) {
+            drawPlayfield(keyStates);
+            profiler.addDrawCalls(2 + COLUMN_COUNT * 2);
+            return;
+        }
+
+        SDL_RenderCopy(renderer, playfieldLayers[0], nullptr, nullptr);
+        profiler.addDrawCalls(1);
+
+        for (int i = 0; i < COLUMN_COUNT; i++) {
+            if (keyStates[i]) {
+                SDL_Rect keyRect = getKeyAreaRect(i);
+                SDL_RenderCopy(renderer, playfieldLayers[1], &keyRect, &keyRect);
+                profiler.addDrawCalls(1);
+            }
+        }
+    }
+
+    // Every visible note as coloured quads, submitted in one SDL_RenderGeometry call.
+    void renderNotes() {
+        const PlayState& play = engine.getState();
+        size_t liveNotes = 0;
+        for (int column = 0; column < COLUMN_COUNT; column++) {
+            liveNotes += play.columnNotes[column].size();
+        }
+        reserveNoteBatch(liveNotes);
+
+        float songTime = engine.getInterpolatedSongTime();
+        float noteWidth = columnWidth - 10.0f;
+        size_t quadCount = 0;
+        for (int column = 0; column < COLUMN_COUNT; column++) {
+            const NoteQueue& queue = play.columnNotes[column];
+            const SDL_Color& color = COLUMN_COLORS[column];
+            float left = column * columnWidth + 5.0f;
+            float right = left + noteWidth;
+
+            if (noteYs.size() < queue.size()) {
+                noteYs.resize(queue.size());
+            }
+            queue.projectY(songTime, scrollSpeed, JUDGMENT_LINE_Y, noteYs.data());
+
+            for (size_t i = 0; i < queue.size(); i++) {
+                float top = noteYs[i];
+                if (top < -NOTE_HEIGHT) break;  // the rest are further above the screen
+                float bottom = top + NOTE_HEIGHT;
+
+                SDL_Vertex* quad = &noteVertices[quadCount * 4];
+                quad[0] = {{left, top}, color, {0.0f, 0.0f}};
+                quad[1] = {{right, top}, color, {0.0f, 0.0f}};
+                quad[2] = {{left, bottom}, color, {0.0f, 0.0f}};
+                quad[3] = {{right, bottom}, color, {0.0f, 0.0f}};
+                quadCount++;
+            }
+        }
+
+        if (quadCount > 0) {
+            SDL_RenderGeometry(renderer, nullptr,
+                               noteVertices.data(), static_cast<int>(quadCount * 4),
+                               noteIndices.data(), static_cast<int>(quadCount * 6));
+            profiler.addDrawCalls(1);
+        }
+    }
+
+    // Grows the note vertex and index buffers; after warm-up this is a no-op.
+    void reserveNoteBatch(size_t quads) {
+        size_t capacity = noteVertices.size() / 4;
+        if (quads <= capacity) return;
+
+        capacity = std::max(quads, std::max<size_t>(capacity * 2, 256));
+        noteVertices.resize(capacity * 4);
+        noteIndices.resize(capacity * 6);
+        for (size_t i = 0; i < capacity; i++) {
+            int quad = static_cast<int>(i * 4);
+            int* index = &noteIndices[i * 6];
+            index[0] = quad;
+            index[1] = quad + 1;
+            index[2] = quad + 2;
+            index[3] = quad + 2;
+            index[4] = quad + 1;
+            index[5] = quad + 3;
         }
+    }
+
+    void render() {
+        const PlayState& play = engine.getState();
+        renderPlayfield();
+        renderNotes();
+        
+        renderText(frameArena.format("Score: %d", play.score), 10, 10, {255, 255, 255, 255});
+        renderText(frameArena.format("Combo: %dx", play.combo), 10, 40, {255, 255, 255, 255});
         
-        renderText("Acc: " + std::to_string(static_cast<int>(accuracy)) + "." + 
-                   std::to_string(static_cast<int>(accuracy * 100) % 100) + "%", 
-                   10, 70, {255, 255, 255, 255});
+        renderText(frameArena.format("Acc: %.2f%%", play.getAccuracy()), 10, 70, {255, 255, 255, 255});
         
         if (!useRandomNotes) {
-            renderText("Time: " + std::to_string(static_cast<int>(gameTime)), 10, 100, {255, 255, 255, 255});
+            renderText(frameArena.format("Time: %d", static_cast<int>(play.gameTime)), 10, 100, {255, 255, 255, 255});
         }
         
-        if (currentJudgment.type != JudgmentType::NONE) {
-            renderText(currentJudgment.text, 
+        if (play.currentJudgment.type != JudgmentType::NONE) {
+            renderText(play.currentJudgment.text, 
                       SCREEN_WIDTH / 2 - 50, 
                       JUDGMENT_LINE_Y - 50,
-                      currentJudgment.color);
+                      play.currentJudgment.color);
         }
         
         if (!useRandomNotes) {
-            renderText(currentBeatmap.getTitle(), 
+            renderText(chart->getTitle().c_str(), 
                       SCREEN_WIDTH / 2 - 100, 
                       10,
                       {200, 200, 255, 255});
@@ -835,109 +4752,594 @@ private:
                       SCREEN_HEIGHT / 4,
                       {255, 100, 100, 255});
                       
-            renderText("Final Score: " + std::to_string(score), 
+            renderText(frameArena.format("Final Score: %d", play.score), 
                       SCREEN_WIDTH / 2 - 100, 
                       SCREEN_HEIGHT / 2 - 60,
                       {255, 255, 255, 255});
                       
-            renderText("Max Combo: " + std::to_string(maxCombo) + "x", 
+            renderText(frameArena.format("Max Combo: %dx", play.maxCombo), 
                       SCREEN_WIDTH / 2 - 100, 
                       SCREEN_HEIGHT / 2 - 30,
                       {255, 255, 255, 255});
                       
-            float accuracy = 100.0f;
-            if (totalHits > 0) {
-                accuracy = (perfectHits * 300.0f + greatHits * 200.0f + goodHits * 100.0f) / 
-                         (totalHits * 300.0f) * 100.0f;
-            }
-            
-            renderText("Accuracy: " + std::to_string(static_cast<int>(accuracy)) + "." + 
-                     std::to_string(static_cast<int>(accuracy * 100) % 100) + "%", 
+            renderText(frameArena.format("Accuracy: %.2f%%", play.getAccuracy()), 
                      SCREEN_WIDTH / 2 - 100, 
                      SCREEN_HEIGHT / 2,
                      {255, 255, 255, 255});
                      
-            renderText("Perfect: " + std::to_string(perfectHits), 
+            renderText(frameArena.format("Perfect: %d", play.perfectHits), 
                      SCREEN_WIDTH / 2 - 100, 
                      SCREEN_HEIGHT / 2 + 30,
                      {255, 230, 0, 255});
                      
-            renderText("Great: " + std::to_string(greatHits), 
+            renderText(frameArena.format("Great: %d", play.greatHits), 
                      SCREEN_WIDTH / 2 - 100, 
                      SCREEN_HEIGHT / 2 + 60,
                      {0, 255, 0, 255});
                      
-            renderText("Good: " + std::to_string(goodHits), 
+            renderText(frameArena.format("Good: %d", play.goodHits), 
                      SCREEN_WIDTH / 2 - 100, 
                      SCREEN_HEIGHT / 2 + 90,
                      {0, 200, 255, 255});
                      
-            renderText("Miss: " + std::to_string(missedHits), 
+            renderText(frameArena.format("Miss: %d", play.missedHits), 
                      SCREEN_WIDTH / 2 - 100, 
                      SCREEN_HEIGHT / 2 + 120,
                      {255, 0, 0, 255});
+
+            renderText(frameArena.format("Error: %+.1f ms  UR: %.1f", play.hitErrorMean, play.unstableRate), 
+                     SCREEN_WIDTH / 2 - 100, 
+                     SCREEN_HEIGHT / 2 + 150,
+                     {200, 200, 200, 255});
                      
-            renderText("Press SPACE to restart", 
+            renderText("Press SPACE or R to restart", 
                      SCREEN_WIDTH / 2 - 120, 
                      SCREEN_HEIGHT - 60,
                      {255, 255, 255, 255});
                      
+            flushText();
             SDL_RenderPresent(renderer);
             return;
         }
         
         if (!gameStarted) {
 
-            renderText("Press SPACE to start", 
+            renderText(isLoading() ? "Loading..." : "Press SPACE to start", 
                       SCREEN_WIDTH / 2 - 100, 
                       SCREEN_HEIGHT / 2,
                       {255, 255, 255, 255});
                       
-            renderText("Press R to reload beatmap", 
+            renderText("Press F5 to reload beatmap", 
                       SCREEN_WIDTH / 2 - 120, 
                       SCREEN_HEIGHT / 2 + 30,
                       {200, 200, 200, 255});
         }
         
+        flushText();
         SDL_RenderPresent(renderer);
     }
     
-    void renderText(const std::string& text, int x, int y, SDL_Color color) {
-        if (font == nullptr) return;
-        
-        SDL_Surface* surface = TTF_RenderText_Solid(font, text.c_str(), color);
-        if (surface == nullptr) {
-            std::cerr << "Unable to render text surface! TTF_Error: " << TTF_GetError() << std::endl;
+    void renderText(const char* text, int x, int y, SDL_Color color) {
+        FrameProfiler::Scope scope(profiler, ProfileStage::TEXT);
+        glyphAtlas.drawText(renderer, profiler, text, x, y, color);
+    }
+
+    void flushText() {
+        FrameProfiler::Scope scope(profiler, ProfileStage::TEXT);
+        glyphAtlas.flush(renderer, profiler);
+    }
+};
+
+// The stream-based parser Beatmap used before parseText(), kept only as the
+// baseline for --bench-parse.
+size_t parseBeatmapTextLegacy(const std::string& text) {
+    std::istringstream file(text);
+    std::vector<BeatmapNote> notes;
+    std::string line;
+
+    for (int i = 0; i < 3; i++) {
+        std::getline(file, line);
+    }
+
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string timeStr, columnStr;
+
+        if (line.empty() || line[0] == '#' || line[0] == '/') {
+            continue;
+        }
+
+        if (std::getline(iss, timeStr, ',') && std::getline(iss, columnStr)) {
+            try {
+                BeatmapNote note;
+                note.time = std::stof(timeStr);
+                note.column = std::stoi(columnStr);
+                if (note.column >= 0 && note.column < COLUMN_COUNT) {
+                    notes.push_back(note);
+                }
+            } catch (const std::exception&) {
+            }
+        }
+    }
+
+    std::sort(notes.begin(), notes.end(),
+          [](const BeatmapNote& a, const BeatmapNote& b) {
+              return a.time < b.time;
+          });
+    return notes.size();
+}
+
+// --bench-parse: parses a synthetic chart with the legacy and current text
+// parsers and prints throughput for both.
+int runParseBenchmark(size_t noteLines) {
+    const int iterations = 3;
+    std::string text = generateSyntheticBeatmapText(noteLines);
+    double megabytes = text.size() / (1024.0 * 1024.0);
+
+    std::cout << "Parsing " << noteLines << " note lines (" << megabytes << " MB), best of "
+              << iterations << " runs" << std::endl;
+
+    auto measure = [&](const char* name, auto parse) {
+        double best = 0.0;
+        size_t notes = 0;
+        for (int i = 0; i < iterations; i++) {
+            auto start = std::chrono::high_resolution_clock::now();
+            notes = parse();
+            double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+            if (i == 0 || seconds < best) best = seconds;
+        }
+        std::cout << "  " << name << ": " << notes << " notes in " << best * 1000.0 << " ms, "
+                  << megabytes / best << " MB/s" << std::endl;
+    };
+
+    measure("legacy istringstream", [&]() {
+        return parseBeatmapTextLegacy(text);
+    });
+
+    measure("from_chars", [&]() {
+        Beatmap beatmap;
+        beatmap.parseText(text.data(), text.size(), "synthetic");
+        return beatmap.getNoteCount();
+    });
+
+    return 0;
+}
+
+// --bench-notes: times the note kernels over sorted columns of 10k, 100k and
+// 1M live notes for every instruction set this CPU supports.
+int runNoteKernelBenchmark() {
+    const size_t sizes[] = {10000, 100000, 1000000};
+
+    std::vector<const NoteKernels::Table*> tables = {&NoteKernels::SCALAR};
+#if NOTE_KERNELS_X86
+    if (SDL_HasSSE2()) tables.push_back(&NoteKernels::SSE2);
+    if (SDL_HasAVX2()) tables.push_back(&NoteKernels::AVX2);
+#endif
+
+    for (size_t count : sizes) {
+        std::vector<float> hitTimes(count);
+        std::vector<float> ys(count);
+        for (size_t i = 0; i < count; i++) {
+            hitTimes[i] = i * 0.001f;
+        }
+        // Roughly half the notes are expired, so the miss scan has to walk them.
+        float cutoff = hitTimes[count / 2];
+        int repeats = static_cast<int>(std::max<size_t>(1, 20000000 / count));
+
+        std::cout << count << " live notes:" << std::endl;
+        for (const NoteKernels::Table* table : tables) {
+            volatile size_t sink = 0;
+
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int r = 0; r < repeats; r++) {
+                table->projectY(hitTimes.data(), count, r * 0.001f, NOTE_SPEED, JUDGMENT_LINE_Y, ys.data());
+            }
+            double projectSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+            start = std::chrono::high_resolution_clock::now();
+            for (int r = 0; r < repeats; r++) {
+                sink = sink + table->countBefore(hitTimes.data(), count, cutoff);
+            }
+            double scanSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+            double notes = static_cast<double>(count) * repeats;
+            std::cout << "  " << table->name << ": projectY " << projectSeconds * 1e9 / notes << " ns/note, "
+                      << "miss scan " << scanSeconds * 1e9 / (notes / 2) << " ns/note" << std::endl;
+        }
+    }
+
+    return 0;
+}
+
+// Mixes every voice through 512-frame stereo buffers, as the audio callback
+// would, and reports how many voice-buffers each kernel set mixes per
+// millisecond of callback time.
+int runMixerBenchmark() {
+    const int bufferFrames = 512;
+    const int channels = 2;
+    const int buffers = 20000;
+    const uint64_t voiceFrames = static_cast<uint64_t>(bufferFrames) * buffers;
+
+    std::vector<float> samples(voiceFrames * channels);
+    uint32_t noise = 1;
+    for (float& sample : samples) {
+        noise = noise * 1664525u + 1013904223u;
+        sample = static_cast<float>(noise >> 8) / 8388608.0f - 1.0f;
+    }
+    std::vector<float> out(static_cast<size_t>(bufferFrames) * channels);
+
+    std::vector<const MixKernels::Table*> tables = {&MixKernels::SCALAR};
+#if NOTE_KERNELS_X86
+    if (SDL_HasSSE()) tables.push_back(&MixKernels::SSE);
+    if (SDL_HasAVX()) tables.push_back(&MixKernels::AVX);
+#endif
+
+    double budgetMs = bufferFrames * 1000.0 / AUDIO_FREQUENCY;
+    std::cout << MIXER_VOICES << " voices, " << bufferFrames << "-frame buffers ("
+              << budgetMs << " ms of audio each):" << std::endl;
+    for (const MixKernels::Table* table : tables) {
+        SoftwareMixer mixer;
+        mixer.setChannels(channels);
+        mixer.setKernels(*table);
+        for (int voice = 0; voice < MIXER_VOICES; voice++) {
+            mixer.play(voice, samples.data(), voiceFrames, 0, 0.1f);
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int b = 0; b < buffers; b++) {
+            mixer.mix(out.data(), bufferFrames, static_cast<uint64_t>(b) * bufferFrames);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+        double voicesPerMs = static_cast<double>(MIXER_VOICES) * buffers / ms;
+        std::cout << "  " << table->name << ": " << voicesPerMs << " voice-buffers per ms, "
+                  << static_cast<int>(voicesPerMs * budgetMs) << " voices fit one buffer's time" << std::endl;
+    }
+
+    return 0;
+}
+
+// --bench-sim: plays a chart (a synthetic 3-minute one by default) through
+// GameplayEngine with no window or audio, pressing every note with a
+// normally distributed timing error, and reports how much faster than real
+// time the rules run, tick by tick and skipping idle ticks.
+int runSimulationBenchmark(const std::string& chartFile) {
+    const int plays = 20;
+
+    std::shared_ptr<Beatmap> chart = std::make_shared<Beatmap>();
+    if (chartFile.empty()) {
+        std::string text = generateSyntheticBeatmapText(3600);
+        if (!chart->parseText(text.data(), text.size(), "synthetic")) {
+            return 1;
+        }
+    } else if (!chart->loadFromFile(chartFile)) {
+        return 1;
+    }
+
+    std::vector<ColumnPress> timeline(chart->getNoteCount());
+    std::mt19937 rng(54321);
+    std::normal_distribution<double> errorDist(0.0, 0.03);
+    for (size_t i = 0; i < timeline.size(); i++) {
+        timeline[i].column = chart->getNoteColumns()[i];
+        timeline[i].time = chart->getNoteTimes()[i] + chart->getOffset() + errorDist(rng);
+    }
+    std::stable_sort(timeline.begin(), timeline.end(),
+                     [](const ColumnPress& a, const ColumnPress& b) { return a.time < b.time; });
+    PressSequence presses;
+    for (const ColumnPress& press : timeline) {
+        presses.push(press.column, press.time);
+    }
+
+    double endTime = chart->getSongLength() + chart->getOffset() + 1.0;
+    std::cout << chart->getNoteCount() << " notes, " << endTime << " s per play, " << plays << " plays" << std::endl;
+
+    int scores[2] = {0, 0};
+    for (int skip = 0; skip < 2; skip++) {
+        GameplayEngine engine;
+        engine.setChart(chart);
+        engine.setSkipIdleTicks(skip != 0);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int play = 0; play < plays; play++) {
+            engine.reset();
+            presses.rewind();
+            engine.advance(endTime, std::numeric_limits<int>::max(), presses,
+                           [](const ColumnPress&, const PressResult&, float) {});
+            if (!engine.isFinished()) {
+                std::cerr << "Play did not finish by " << endTime << " s" << std::endl;
+                return 1;
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+        engine.computeHitErrorStats();
+        const PlayState& state = engine.getState();
+        scores[skip] = state.score;
+        std::cout << "  " << (skip ? "skipping idle ticks" : "every tick") << ": " << seconds * 1000.0 << " ms, "
+                  << endTime * plays / seconds << "x real time" << std::endl;
+        std::cout << "    score " << state.score << ", max combo " << state.maxCombo << ", accuracy "
+                  << state.getAccuracy() << "%, " << state.perfectHits << "/" << state.greatHits << "/"
+                  << state.goodHits << "/" << state.missedHits << ", UR " << state.unstableRate << std::endl;
+    }
+
+    if (scores[0] != scores[1]) {
+        std::cerr << "Skipping idle ticks changed the score" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Calls fn(index, thread) for every index in [0, count) on `threads` threads.
+// Each thread starts with an equal slice and takes indices from its front;
+// one whose slice runs out steals the back half of another's, so a few slow
+// items do not leave the rest of the threads idle.
+template <typename Fn>
+void parallelForStealing(size_t count, unsigned threads, Fn fn) {
+    struct alignas(64) Slice {
+        std::atomic<uint64_t> bounds;  // begin << 32 | end
+    };
+    auto pack = [](uint64_t begin, uint64_t end) { return begin << 32 | end; };
+
+    std::vector<Slice> slices(threads);
+    for (unsigned t = 0; t < threads; t++) {
+        slices[t].bounds.store(pack(count * t / threads, count * (t + 1) / threads));
+    }
+
+    auto work = [&](unsigned self) {
+        for (;;) {
+            uint64_t bounds = slices[self].bounds.load(std::memory_order_acquire);
+            uint32_t begin = static_cast<uint32_t>(bounds >> 32);
+            uint32_t end = static_cast<uint32_t>(bounds);
+            if (begin < end) {
+                if (slices[self].bounds.compare_exchange_weak(bounds, pack(begin + 1, end))) {
+                    fn(static_cast<size_t>(begin), self);
+                }
+                continue;
+            }
+
+            bool stole = false;
+            for (unsigned k = 1; k < threads && !stole; k++) {
+                Slice& victim = slices[(self + k) % threads];
+                uint64_t victimBounds = victim.bounds.load(std::memory_order_acquire);
+                uint32_t victimBegin = static_cast<uint32_t>(victimBounds >> 32);
+                uint32_t victimEnd = static_cast<uint32_t>(victimBounds);
+                if (victimBegin >= victimEnd) continue;
+
+                uint32_t middle = victimBegin + (victimEnd - victimBegin) / 2;
+                if (victim.bounds.compare_exchange_strong(victimBounds, pack(victimBegin, middle))) {
+                    // Our own slice is empty, so no one else writes it meanwhile.
+                    slices[self].bounds.store(pack(middle, victimEnd), std::memory_order_release);
+                    stole = true;
+                }
+            }
+            if (!stole) {
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++) {
+        pool.emplace_back(work, t);
+    }
+    work(0);
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+}
+
+struct ReplayVerdict {
+    enum Status { OK, INVALID, OTHER_CHART } status;
+    int score;
+    int maxCombo;
+    float accuracy;
+    int perfectHits;
+    int greatHits;
+    int goodHits;
+    int missedHits;
+};
+
+// --verify-replays: re-judges replay files of one chart with the current
+// rules, on every core, and prints each one's result and the overall rate.
+// Directories are searched for REPLAY_EXTENSION files.
+int runReplayVerifier(const std::string& chartFile, const std::vector<std::string>& arguments) {
+    std::vector<std::string> replayFiles;
+    for (const std::string& argument : arguments) {
+        std::error_code error;
+        if (std::filesystem::is_directory(argument, error)) {
+            for (const auto& entry : std::filesystem::directory_iterator(argument, error)) {
+                if (entry.path().extension() == REPLAY_EXTENSION) {
+                    replayFiles.push_back(entry.path().string());
+                }
+            }
+        } else {
+            replayFiles.push_back(argument);
+        }
+    }
+    std::sort(replayFiles.begin(), replayFiles.end());
+
+    std::shared_ptr<Beatmap> chart = std::make_shared<Beatmap>();
+    if (!chart->loadFromFile(chartFile)) {
+        return 1;
+    }
+    uint64_t chartHash = replayChartHash(*chart);
+    double endTime = chart->getSongLength() + chart->getOffset() + 1.0;
+
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<GameplayEngine> engines(threads);
+    std::vector<PressSequence> sequences(threads);
+    for (GameplayEngine& engine : engines) {
+        engine.setChart(chart);
+        engine.setSkipIdleTicks(true);
+    }
+    std::vector<ReplayVerdict> verdicts(replayFiles.size());
+
+    auto start = std::chrono::high_resolution_clock::now();
+    parallelForStealing(replayFiles.size(), threads, [&](size_t index, unsigned thread) {
+        ReplayVerdict& verdict = verdicts[index];
+        ReplayHeader header;
+        if (!loadReplay(replayFiles[index], header, sequences[thread])) {
+            verdict.status = ReplayVerdict::INVALID;
             return;
         }
-        
-        SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
-        if (texture == nullptr) {
-            std::cerr << "Unable to create texture from rendered text! SDL_Error: " << SDL_GetError() << std::endl;
-            SDL_FreeSurface(surface);
+        if (header.chartHash != chartHash || header.columns != COLUMN_COUNT) {
+            verdict.status = ReplayVerdict::OTHER_CHART;
             return;
         }
-        
-        SDL_Rect renderRect = {x, y, surface->w, surface->h};
-        SDL_RenderCopy(renderer, texture, nullptr, &renderRect);
-        
-        SDL_FreeSurface(surface);
-        SDL_DestroyTexture(texture);
+
+        GameplayEngine& engine = engines[thread];
+        engine.setJudgmentWindows({header.perfectMs, header.greatMs, header.goodMs, header.missMs});
+        engine.reset();
+        engine.advance(endTime, std::numeric_limits<int>::max(), sequences[thread],
+                       [](const ColumnPress&, const PressResult&, float) {});
+
+        const PlayState& state = engine.getState();
+        verdict.status = ReplayVerdict::OK;
+        verdict.score = state.score;
+        verdict.maxCombo = state.maxCombo;
+        verdict.accuracy = state.getAccuracy();
+        verdict.perfectHits = state.perfectHits;
+        verdict.greatHits = state.greatHits;
+        verdict.goodHits = state.goodHits;
+        verdict.missedHits = state.missedHits;
+    });
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    size_t rejected = 0;
+    for (size_t i = 0; i < replayFiles.size(); i++) {
+        const ReplayVerdict& verdict = verdicts[i];
+        std::cout << replayFiles[i] << ": ";
+        if (verdict.status == ReplayVerdict::INVALID) {
+            std::cout << "not a readable replay" << std::endl;
+            rejected++;
+        } else if (verdict.status == ReplayVerdict::OTHER_CHART) {
+            std::cout << "recorded on a different chart" << std::endl;
+            rejected++;
+        } else {
+            std::cout << "score " << verdict.score << ", max combo " << verdict.maxCombo
+                      << ", accuracy " << verdict.accuracy << "%, " << verdict.perfectHits << "/"
+                      << verdict.greatHits << "/" << verdict.goodHits << "/" << verdict.missedHits << std::endl;
+        }
     }
-};
+
+    std::cout << "Verified " << replayFiles.size() - rejected << " of " << replayFiles.size() << " replays of "
+              << chart->getTitle() << " in " << seconds * 1000.0 << " ms on " << threads << " threads: "
+              << replayFiles.size() / seconds << " replays/s" << std::endl;
+    return rejected == 0 ? 0 : 1;
+}
 
 int main(int argc, char* argv[]) {
     SDL_SetMainReady();
 
     std::string beatmapFile = "his_theme.txt";
+
+    if (argc > 1 && std::string(argv[1]) == "--bench-parse") {
+        size_t noteLines = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000000;
+        return runParseBenchmark(noteLines);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--bench-notes") {
+        return runNoteKernelBenchmark();
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--bench-mixer") {
+        return runMixerBenchmark();
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--bench-sim") {
+        return runSimulationBenchmark(argc > 2 ? argv[2] : "");
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--verify-replays") {
+        if (argc < 4) {
+            std::cerr << "Usage: " << argv[0] << " --verify-replays <beatmap> <replay.omr|directory>..." << std::endl;
+            return 1;
+        }
+        return runReplayVerifier(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "--compile-beatmap") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " --compile-beatmap <beatmap.txt> [output.omb]" << std::endl;
+            return 1;
+        }
+        std::string input = argv[2];
+        std::string output = argc > 3 ? argv[3] : input + COMPILED_BEATMAP_EXTENSION;
+        return Beatmap::compile(input, output) ? 0 : 1;
+    }
     
-    if (argc > 1) {
-        beatmapFile = argv[1];
+    bool strictAllocations = false;
+    FramePacing framePacing = FramePacing::CAPPED;
+    int targetFps = DEFAULT_TARGET_FPS;
+    JudgmentWindows judgmentWindows = JudgmentWindows::standard();
+    int audioBufferFrames = DEFAULT_AUDIO_BUFFER_FRAMES;
+    size_t keysoundBudgetMb = DEFAULT_KEYSOUND_BUDGET_MB;
+    bool musicCache = true;
+    bool autoplay = false;
+    bool chartGiven = false;
+    double benchmarkSeconds = 0.0;
+    std::string benchmarkOutput = "benchmark.json";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--strict-alloc") {
+            strictAllocations = true;
+        } else if (arg == "--fps" && i + 1 < argc) {
+            framePacing = FramePacing::CAPPED;
+            targetFps = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--od" && i + 1 < argc) {
+            judgmentWindows = JudgmentWindows::fromOverallDifficulty(static_cast<float>(std::atof(argv[++i])));
+        } else if (arg == "--audio-buffer" && i + 1 < argc) {
+            audioBufferFrames = std::atoi(argv[++i]);
+            if (audioBufferFrames < MIN_AUDIO_BUFFER_FRAMES || audioBufferFrames > MAX_AUDIO_BUFFER_FRAMES ||
+                (audioBufferFrames & (audioBufferFrames - 1)) != 0) {
+                std::cerr << "--audio-buffer must be 256, 512 or 1024 frames" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--keysound-budget" && i + 1 < argc) {
+            keysoundBudgetMb = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--no-music-cache") {
+            musicCache = false;
+        } else if (arg == "--vsync") {
+            framePacing = FramePacing::VSYNC;
+        } else if (arg == "--uncapped") {
+            framePacing = FramePacing::UNCAPPED;
+        } else if (arg == "--autoplay") {
+            autoplay = true;
+        } else if (arg == "--benchmark") {
+            if (benchmarkSeconds <= 0.0) benchmarkSeconds = DEFAULT_BENCHMARK_SECONDS;
+        } else if (arg == "--benchmark-seconds" && i + 1 < argc) {
+            benchmarkSeconds = std::max(1.0, std::atof(argv[++i]));
+        } else if (arg == "--benchmark-output" && i + 1 < argc) {
+            benchmarkOutput = argv[++i];
+        } else {
+            beatmapFile = arg;
+            chartGiven = true;
+        }
+    }
+
+    // A benchmark renders as fast as it can with perfect input, so runs on
+    // the same chart do the same work.
+    if (benchmarkSeconds > 0.0) {
+        framePacing = FramePacing::UNCAPPED;
+        autoplay = true;
     }
     
     {
         std::cout << "Creating game instance..." << std::endl;
         OsuMania game;
+        game.setFramePacing(framePacing, targetFps);
+        game.setStrictAllocations(strictAllocations);
+        game.setJudgmentWindows(judgmentWindows);
+        game.setAudioBufferFrames(audioBufferFrames);
+        game.setKeysoundBudget(keysoundBudgetMb << 20);
+        game.setMusicCache(musicCache);
+        game.setAutoplay(autoplay);
+        if (benchmarkSeconds > 0.0) {
+            game.setBenchmark(benchmarkSeconds, benchmarkOutput);
+            if (!chartGiven) {
+                game.setStressChart(static_cast<size_t>(benchmarkSeconds / STRESS_NOTE_INTERVAL));
+            }
+        }
         
         if (!game.initialize(beatmapFile)) {
             std::cerr << "Failed to initialize game" << std::endl;
@@ -945,6 +5347,12 @@ int main(int argc, char* argv[]) {
         }
         
         game.run();
+
+        if (strictAllocations && game.getSteadyStateAllocations() > 0) {
+            std::cerr << "Strict allocation check failed: " << game.getSteadyStateAllocations()
+                      << " heap allocations during steady-state gameplay" << std::endl;
+            return 1;
+        }
     }
     
     std::cout << "Program exiting normally" << std::endl;